@@ -0,0 +1,136 @@
+//
+//  bvh.cpp
+//
+
+#include <algorithm>
+#include "bvh.h"
+
+#define BVH_BINS 12
+
+
+void BVH::build(const std::vector<AABB> &primitiveBounds, int maxLeafSize)
+{
+	this->maxLeafSize = std::max(1, maxLeafSize);
+	nodes.clear();
+	primitiveIndices.clear();
+	if (primitiveBounds.empty())
+	{
+		return;
+	}
+
+	std::vector<glm::vec3> centroids;
+	centroids.reserve(primitiveBounds.size());
+	for (int i = 0; i < (int) primitiveBounds.size(); i++)
+	{
+		primitiveIndices.push_back(i);
+		centroids.push_back(primitiveBounds[i].centroid());
+	}
+
+	// A binary tree over n leaves never needs more than 2n - 1 nodes
+	nodes.reserve(2 * primitiveBounds.size());
+	nodes.push_back({ AABB(), 0, (int) primitiveBounds.size() });
+	subdivide(0, 1, primitiveBounds, centroids);
+}
+
+void BVH::subdivide(int nodeIndex, int depth, const std::vector<AABB> &primitiveBounds,
+					const std::vector<glm::vec3> &centroids)
+{
+	int first = nodes[nodeIndex].leftOrFirst;
+	int count = nodes[nodeIndex].count;
+
+	// Fit the node around its primitives, and find the spread of their centroids
+	AABB bounds;
+	AABB centroidBounds;
+	for (int i = first; i < first + count; i++)
+	{
+		bounds.grow(primitiveBounds[primitiveIndices[i]]);
+		centroidBounds.grow(centroids[primitiveIndices[i]]);
+	}
+	nodes[nodeIndex].bounds = bounds;
+
+	if (count <= maxLeafSize || depth >= BVH_MAX_DEPTH)
+	{
+		return;
+	}
+
+	// Bin centroids along each axis and keep the cheapest split plane
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float lo = centroidBounds.min[axis];
+		float extent = centroidBounds.max[axis] - lo;
+		if (extent <= 0.0f)
+		{
+			continue;
+		}
+
+		AABB binBounds[BVH_BINS];
+		int binCounts[BVH_BINS] = { 0 };
+		float scale = BVH_BINS / extent;
+		for (int i = first; i < first + count; i++)
+		{
+			int prim = primitiveIndices[i];
+			int bin = std::min(BVH_BINS - 1, (int) ((centroids[prim][axis] - lo) * scale));
+			binBounds[bin].grow(primitiveBounds[prim]);
+			binCounts[bin]++;
+		}
+
+		// Sweep from the right to get the area/count to the right of each plane
+		float rightArea[BVH_BINS - 1];
+		int rightCount[BVH_BINS - 1];
+		AABB rightBox;
+		int rightSum = 0;
+		for (int bin = BVH_BINS - 1; bin > 0; bin--)
+		{
+			rightBox.grow(binBounds[bin]);
+			rightSum += binCounts[bin];
+			rightArea[bin - 1] = rightBox.surfaceArea();
+			rightCount[bin - 1] = rightSum;
+		}
+
+		// Then sweep from the left and evaluate the heuristic at each plane
+		AABB leftBox;
+		int leftSum = 0;
+		for (int split = 0; split < BVH_BINS - 1; split++)
+		{
+			leftBox.grow(binBounds[split]);
+			leftSum += binCounts[split];
+			float cost = leftSum * leftBox.surfaceArea() + rightCount[split] * rightArea[split];
+			if (leftSum > 0 && rightCount[split] > 0 && cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	// Splitting must beat intersecting every primitive in one leaf
+	float leafCost = count * bounds.surfaceArea();
+	if (bestAxis < 0 || bestCost >= leafCost)
+	{
+		return;
+	}
+
+	// Partition the primitive indices around the chosen plane
+	float lo = centroidBounds.min[bestAxis];
+	float scale = BVH_BINS / (centroidBounds.max[bestAxis] - lo);
+	int *middle = std::partition(&primitiveIndices[first], &primitiveIndices[first] + count,
+		[&](int prim)
+		{
+			int bin = std::min(BVH_BINS - 1, (int) ((centroids[prim][bestAxis] - lo) * scale));
+			return bin <= bestSplit;
+		});
+	int leftCount = middle - &primitiveIndices[first];
+
+	int left = nodes.size();
+	nodes.push_back({ AABB(), first, leftCount });
+	nodes.push_back({ AABB(), first + leftCount, count - leftCount });
+	nodes[nodeIndex].leftOrFirst = left;
+	nodes[nodeIndex].count = 0;
+
+	subdivide(left, depth + 1, primitiveBounds, centroids);
+	subdivide(left + 1, depth + 1, primitiveBounds, centroids);
+}
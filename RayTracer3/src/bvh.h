@@ -0,0 +1,285 @@
+//
+//  bvh.h
+//
+//  Bounding volume hierarchy over a list of axis aligned boxes.  The tree only
+//  knows about boxes and primitive indices, what a primitive is and how a ray
+//  hits it is left to the caller through the leaf callback of traverse().
+//
+
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+#include <glm/glm.hpp>
+#include "packet.h"
+
+// Deeper nodes are turned into leaves, which bounds the traversal stack
+#define BVH_MAX_DEPTH 64
+
+// Nodes with this many primitives or fewer are never split
+#define BVH_MAX_LEAF_SIZE 2
+
+
+// Axis aligned bounding box
+//
+class AABB
+{
+public:
+	AABB() : min(FLT_MAX), max(-FLT_MAX) {}
+	AABB(const glm::vec3 &min, const glm::vec3 &max) : min(min), max(max) {}
+
+	void grow(const glm::vec3 &p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void grow(const AABB &box)
+	{
+		min = glm::min(min, box.min);
+		max = glm::max(max, box.max);
+	}
+
+	bool isEmpty() const
+	{
+		return min.x > max.x;
+	}
+
+	glm::vec3 centroid() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	// Squared distance from p to the nearest point of the box, 0 inside it
+	float distanceSquared(const glm::vec3 &p) const
+	{
+		glm::vec3 outside = glm::max(glm::max(min - p, p - max), glm::vec3(0.0f));
+		return glm::dot(outside, outside);
+	}
+
+	float surfaceArea() const
+	{
+		if (isEmpty())
+		{
+			return 0.0f;
+		}
+		glm::vec3 extent = max - min;
+		return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	// Slab test, tEnter is set to the distance the ray enters the box
+	//
+	bool intersect(const glm::vec3 &origin, const glm::vec3 &invDir, float tmax, float &tEnter) const
+	{
+		glm::vec3 t0 = (min - origin) * invDir;
+		glm::vec3 t1 = (max - origin) * invDir;
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+		tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tmax));
+		return tEnter <= tExit;
+	}
+
+	// Slab test for every active lane of a packet
+	//
+	simd::SimdMask intersect(const simd::RayPacket &packet, const simd::SimdFloat &tmax) const
+	{
+		simd::SimdFloat tEnter(0.0f);
+		simd::SimdFloat tExit = tmax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			simd::SimdFloat t0 = (simd::SimdFloat(min[axis]) - packet.p[axis]) * packet.invD[axis];
+			simd::SimdFloat t1 = (simd::SimdFloat(max[axis]) - packet.p[axis]) * packet.invD[axis];
+			tEnter = simd::max(tEnter, simd::min(t0, t1));
+			tExit = simd::min(tExit, simd::max(t0, t1));
+		}
+		return packet.active & (tEnter <= tExit);
+	}
+
+	glm::vec3 min, max;
+};
+
+
+// Interior nodes store the index of their left child, the right child always
+// follows it.  Leaves store a range into the BVH primitive index list.
+//
+struct BVHNode
+{
+	AABB bounds;
+	int leftOrFirst;
+	int count;         // 0 for interior nodes
+
+	bool isLeaf() const
+	{
+		return count > 0;
+	}
+};
+
+
+class BVH
+{
+public:
+	// Build with the surface area heuristic, evaluated over a fixed number of
+	// bins per axis instead of every possible split.  Callers that test a
+	// whole leaf at once can ask for bigger leaves.
+	void build(const std::vector<AABB> &primitiveBounds, int maxLeafSize = BVH_MAX_LEAF_SIZE);
+
+	bool isEmpty() const
+	{
+		return nodes.empty();
+	}
+
+	AABB bounds() const
+	{
+		return nodes.empty() ? AABB() : nodes[0].bounds;
+	}
+
+	// Visit every leaf whose box the ray enters before tmax.  visit(first, count)
+	// gets the leaf's range [first, first + count) of primitiveIndices.  tmax
+	// is re-read after each visit so a closest hit search can shrink it as it
+	// goes.  visit returns true to stop the traversal (any hit queries).
+	//
+	template<class Visitor>
+	void traverseLeaves(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, Visitor visit) const
+	{
+		if (nodes.empty())
+		{
+			return;
+		}
+
+		glm::vec3 invDir = 1.0f / direction;
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int nodeIndex = 0;
+		float tEnter;
+		if (!nodes[0].bounds.intersect(origin, invDir, tmax, tEnter))
+		{
+			return;
+		}
+
+		while (true)
+		{
+			const BVHNode &node = nodes[nodeIndex];
+			if (node.isLeaf())
+			{
+				if (visit(node.leftOrFirst, node.count))
+				{
+					return;
+				}
+			}
+			else
+			{
+				// Descend into the nearer child first, push the other one
+				int left = node.leftOrFirst;
+				int right = left + 1;
+				float tLeft, tRight;
+				bool hitLeft = nodes[left].bounds.intersect(origin, invDir, tmax, tLeft);
+				bool hitRight = nodes[right].bounds.intersect(origin, invDir, tmax, tRight);
+				if (hitLeft && hitRight)
+				{
+					if (tRight < tLeft)
+					{
+						std::swap(left, right);
+					}
+					stack[stackSize++] = right;
+					nodeIndex = left;
+					continue;
+				}
+				else if (hitLeft || hitRight)
+				{
+					nodeIndex = hitLeft ? left : right;
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+			{
+				return;
+			}
+			nodeIndex = stack[--stackSize];
+		}
+	}
+
+	// Same walk one primitive at a time, visit(primitive) returns true to stop
+	//
+	template<class Visitor>
+	void traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, Visitor visit) const
+	{
+		traverseLeaves(origin, direction, tmax, [&](int first, int count)
+		{
+			for (int i = first; i < first + count; i++)
+			{
+				if (visit(primitiveIndices[i]))
+				{
+					return true;
+				}
+			}
+			return false;
+		});
+	}
+
+	// Packet version of traverse(), a node is visited while any lane of the
+	// packet enters its box.  visit(primitive, lanes) gets the lanes that
+	// entered the leaf.  Children are ordered by the first active lane.
+	//
+	template<class Visitor>
+	void traversePacket(const simd::RayPacket &packet, const simd::SimdFloat &tmax, Visitor visit) const
+	{
+		if (nodes.empty())
+		{
+			return;
+		}
+
+		int lane = 0;
+		while (!packet.active.lane(lane))
+		{
+			lane++;
+		}
+		glm::vec3 origin = packet.origin(lane);
+		glm::vec3 direction = packet.direction(lane);
+
+		// Both children are pushed, so one more slot than the tree is deep
+		int stack[BVH_MAX_DEPTH + 1];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0)
+		{
+			const BVHNode &node = nodes[stack[--stackSize]];
+			simd::SimdMask lanes = node.bounds.intersect(packet, tmax);
+			if (!lanes.any())
+			{
+				continue;
+			}
+
+			if (node.isLeaf())
+			{
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++)
+				{
+					visit(primitiveIndices[i], lanes);
+				}
+				continue;
+			}
+
+			// Push the far child first so the near one is popped next
+			int left = node.leftOrFirst;
+			int right = left + 1;
+			float leftDistance = glm::dot(nodes[left].bounds.centroid() - origin, direction);
+			float rightDistance = glm::dot(nodes[right].bounds.centroid() - origin, direction);
+			if (rightDistance < leftDistance)
+			{
+				std::swap(left, right);
+			}
+			stack[stackSize++] = right;
+			stack[stackSize++] = left;
+		}
+	}
+
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitiveIndices;
+
+private:
+	void subdivide(int nodeIndex, int depth, const std::vector<AABB> &primitiveBounds,
+				   const std::vector<glm::vec3> &centroids);
+
+	int maxLeafSize = BVH_MAX_LEAF_SIZE;
+};
@@ -0,0 +1,106 @@
+//
+//  lighttree.cpp
+//
+
+#include "lighttree.h"
+
+
+void LightTree::build(const std::vector<AABB> &bounds, const std::vector<float> &intensities)
+{
+	nodes.clear();
+	std::vector<int> lights;
+	for (int l = 0; l < (int) bounds.size(); l++)
+	{
+		if (intensities[l] > 0.0f && !bounds[l].isEmpty())
+		{
+			lights.push_back(l);
+		}
+	}
+	if (!lights.empty())
+	{
+		nodes.reserve(2 * lights.size() - 1);
+		buildNode(lights, 0, lights.size(), bounds, intensities);
+	}
+}
+
+// Split at the median along the longest axis of the light centroids, the
+// root ends up at index 0
+//
+int LightTree::buildNode(std::vector<int> &lights, int begin, int end, const std::vector<AABB> &bounds,
+						 const std::vector<float> &intensities)
+{
+	int index = nodes.size();
+	nodes.push_back(Node());
+	Node node;
+	node.intensity = 0.0f;
+	node.left = node.right = -1;
+	node.light = lights[begin];
+
+	AABB centroids;
+	for (int i = begin; i < end; i++)
+	{
+		node.bounds.grow(bounds[lights[i]]);
+		node.intensity += intensities[lights[i]];
+		centroids.grow(bounds[lights[i]].centroid());
+	}
+
+	if (end - begin > 1)
+	{
+		glm::vec3 extent = centroids.max - centroids.min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		int middle = (begin + end) / 2;
+		std::nth_element(lights.begin() + begin, lights.begin() + middle, lights.begin() + end, [&](int a, int b)
+		{
+			return bounds[a].centroid()[axis] < bounds[b].centroid()[axis];
+		});
+		node.left = buildNode(lights, begin, middle, bounds, intensities);
+		node.right = buildNode(lights, middle, end, bounds, intensities);
+	}
+
+	nodes[index] = node;
+	return index;
+}
+
+float LightTree::importance(const Node &node, const glm::vec3 &p)
+{
+	glm::vec3 diagonal = node.bounds.max - node.bounds.min;
+	float nearest = std::max(glm::dot(diagonal, diagonal) * 0.25f, 1e-4f);
+	return node.intensity / std::max(node.bounds.distanceSquared(p), nearest);
+}
+
+int LightTree::pick(const glm::vec3 &p, float u, float &probability) const
+{
+	probability = 1.0f;
+	if (nodes.empty())
+	{
+		return -1;
+	}
+
+	int index = 0;
+	while (nodes[index].left >= 0)
+	{
+		const Node &node = nodes[index];
+		float left = importance(nodes[node.left], p);
+		float right = importance(nodes[node.right], p);
+		if (left + right <= 0.0f)
+		{
+			return -1;
+		}
+
+		// Reuse what is left of u for the next level down
+		float pLeft = left / (left + right);
+		if (u < pLeft)
+		{
+			index = node.left;
+			probability *= pLeft;
+			u = u / pLeft;
+		}
+		else
+		{
+			index = node.right;
+			probability *= 1.0f - pLeft;
+			u = std::min((u - pLeft) / (1.0f - pLeft), 0.99999994f);
+		}
+	}
+	return nodes[index].light;
+}
@@ -0,0 +1,51 @@
+//
+//  lighttree.h
+//
+//  Binary tree over the lights of a scene, for picking a light at random in
+//  proportion to how much it can add at a shading point.  Each node keeps
+//  the bounds and total intensity of the lights below it, so a pick walks
+//  one path down the tree and costs log(lights) rather than a visit to
+//  every light.
+//
+
+#pragma once
+#include <vector>
+#include "bvh.h"
+
+
+class LightTree
+{
+public:
+	// Bounds of each light's samples and its intensity, indexed by light.
+	// Lights without intensity are left out.
+	void build(const std::vector<AABB> &bounds, const std::vector<float> &intensities);
+
+	bool isEmpty() const
+	{
+		return nodes.empty();
+	}
+
+	// Walk down from the root with u in [0, 1), taking each child in
+	// proportion to its importance at p.  Returns the light and sets the
+	// probability it had of being picked, or -1 if no light was picked.
+	int pick(const glm::vec3 &p, float u, float &probability) const;
+
+private:
+	struct Node
+	{
+		AABB bounds;
+		float intensity;
+		int left, right;     // children, -1 for a leaf
+		int light;           // light of a leaf
+	};
+
+	// Estimated contribution at p, intensity over the squared distance to
+	// the bounds.  Close up the distance is floored by the node's size so
+	// a point inside a big cluster does not see it as infinitely bright.
+	static float importance(const Node &node, const glm::vec3 &p);
+
+	int buildNode(std::vector<int> &lights, int begin, int end, const std::vector<AABB> &bounds,
+				  const std::vector<float> &intensities);
+
+	std::vector<Node> nodes;
+};
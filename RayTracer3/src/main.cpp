@@ -1,8 +1,162 @@
 #include "ofMain.h"
 #include "ofApp.h"
+#include "scene.h"
 
 //========================================================================
-int main( ){
+// Batch render without a window or GL context:
+//
+//   RayTracer3 --headless [--scene file] [--width w] [--height h] [--samples n]
+//                         [--threads n] [--output file] [--compile-scene file]
+//                         [--region x0 y0 x1 y1] [--tiles first last]
+//                         [--heatmap tests|time]
+//
+// Prints wall time, ray throughput and the stats JSON (also saved next to
+// the image) when done.  --compile-scene writes the scene in binary form
+// instead of rendering it.  --region renders only pixels [x0, x1) x
+// [y0, y1), rows counted from the top, and --tiles only tiles [first, last)
+// of them.  Either one composites into the output image if it already
+// exists, so a script can fill in a frame slice by slice; the output then
+// defaults to image.png, and JPEG outputs are refused.  --heatmap also
+// saves the cost of every pixel as a false color image beside the output.
+//
+int renderHeadless(int argc, char *argv[])
+{
+	ofApp app;
+	std::string output = "image.jpg";
+	bool outputGiven = false;
+	std::string compiledScene;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--width" && hasValue)
+		{
+			app.imageWidth = ofToInt(argv[++i]);
+		}
+		else if (arg == "--height" && hasValue)
+		{
+			app.imageHeight = ofToInt(argv[++i]);
+		}
+		else if (arg == "--samples" && hasValue)
+		{
+			app.samplesPerPixel = ofToInt(argv[++i]);
+		}
+		else if (arg == "--threads" && hasValue)
+		{
+			app.numThreads = std::max(1, ofToInt(argv[++i]));
+		}
+		else if (arg == "--output" && hasValue)
+		{
+			output = argv[++i];
+			outputGiven = true;
+		}
+		else if (arg == "--scene" && hasValue)
+		{
+			app.sceneFile = argv[++i];
+		}
+		else if (arg == "--compile-scene" && hasValue)
+		{
+			compiledScene = argv[++i];
+		}
+		else if (arg == "--region" && i + 4 < argc)
+		{
+			app.renderRegion = { ofToInt(argv[i + 1]), ofToInt(argv[i + 2]), ofToInt(argv[i + 3]), ofToInt(argv[i + 4]) };
+			i += 4;
+		}
+		else if (arg == "--heatmap" && hasValue)
+		{
+			app.costHeatmap = true;
+			app.heatmapByTime = std::string(argv[++i]) == "time";
+		}
+		else if (arg == "--tiles" && i + 2 < argc)
+		{
+			app.firstTile = ofToInt(argv[i + 1]);
+			app.lastTile = ofToInt(argv[i + 2]);
+			i += 2;
+		}
+		else if (arg != "--headless")
+		{
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	if (!compiledScene.empty())
+	{
+		SceneFile scene;
+		return scene.load(app.sceneFile) && scene.saveBinary(compiledScene) ? 0 : 1;
+	}
+
+	// Nothing is drawn, keep the image out of GL
+	app.image.setUseTexture(false);
+	app.setupScene();
+
+	// Partial renders go over what earlier ones left in the output, a
+	// different size is allocated afresh.  The output is loaded and saved
+	// again for every slice, so it has to be lossless.
+	Tile region = app.imageRegion();
+	bool partial = region.x1 - region.x0 < app.imageWidth || region.y1 - region.y0 < app.imageHeight ||
+		app.firstTile > 0 || app.lastTile >= 0;
+	std::string extension = ofToLower(ofFilePath::getFileExt(output));
+	if (partial && !outputGiven)
+	{
+		output = "image.png";
+	}
+	else if (partial && (extension == "jpg" || extension == "jpeg"))
+	{
+		cerr << "Partial renders need a lossless output, " << output << " would be re-encoded by every slice" << endl;
+		return 1;
+	}
+	if (partial && ofFile::doesFileExist(ofToDataPath(output)))
+	{
+		app.image.load(ofToDataPath(output));
+	}
+
+	app.rayTrace(output);
+
+	const RenderStats &stats = app.renderStats;
+	cout << "Rendered " << app.imageWidth << "x" << app.imageHeight << " at " << app.samplesPerPixel
+		 << " samples per pixel on " << app.numThreads << " threads to " << output << endl;
+	if (partial)
+	{
+		cout << "Region: " << region.x0 << " " << region.y0 << " " << region.x1 << " " << region.y1
+			 << ", tiles " << app.firstTile << " to " << (app.lastTile < 0 ? "end" : ofToString(app.lastTile)) << endl;
+	}
+	cout << "Wall time: " << stats.wallSeconds << " s" << endl;
+	cout << "Primary rays: " << stats.counters[STAT_PRIMARY_RAYS] << ", shadow rays: "
+		 << stats.counters[STAT_SHADOW_RAYS] << endl;
+	cout << "Rays/second: " << stats.raysPerSecond() << endl;
+	cout << "Stats: " << stats.toJson() << endl;
+	return 0;
+}
+
+//========================================================================
+int main(int argc, char *argv[]){
+
+	auto app = make_shared<ofApp>();
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--headless")
+		{
+			return renderHeadless(argc, argv);
+		}
+		else if (arg == "--scene" && i + 1 < argc)
+		{
+			app->sceneFile = argv[++i];
+		}
+		else if (arg == "--region" && i + 4 < argc)
+		{
+			app->renderRegion = { ofToInt(argv[i + 1]), ofToInt(argv[i + 2]), ofToInt(argv[i + 3]), ofToInt(argv[i + 4]) };
+			i += 4;
+		}
+		else if (arg == "--heatmap" && i + 1 < argc)
+		{
+			app->costHeatmap = true;
+			app->heatmapByTime = std::string(argv[++i]) == "time";
+		}
+	}
 
 	//Use ofGLFWWindowSettings for more options like multi-monitor fullscreen
 	ofGLWindowSettings settings;
@@ -11,7 +165,7 @@ int main( ){
 
 	auto window = ofCreateWindow(settings);
 
-	ofRunApp(window, make_shared<ofApp>());
+	ofRunApp(window, app);
 	ofRunMainLoop();
 
 }
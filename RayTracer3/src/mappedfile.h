@@ -0,0 +1,50 @@
+//
+//  mappedfile.h
+//
+//  Read only view of a whole file mapped into memory.  Pages are loaded by
+//  the OS on first touch and shared with every other process mapping the
+//  same file, so nothing is copied on open.
+//
+
+#pragma once
+#include <cstddef>
+#include <string>
+
+
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	// Map path, unmapping whatever was mapped before.  False if the file
+	// cannot be opened or is empty.
+	bool open(const std::string &path);
+	void close();
+
+	bool isOpen() const
+	{
+		return bytes != nullptr;
+	}
+
+	const unsigned char* data() const
+	{
+		return bytes;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+};
@@ -0,0 +1,403 @@
+//
+//  mesh.cpp
+//
+//  OBJ loading and ray intersection for Mesh
+//
+
+#include <cctype>
+#include <cstdlib>
+#include "ofApp.h"
+
+
+// Ray prepared for the watertight ray/triangle test of Woop, Benthin and
+// Wald.  Triangles are sheared into a space where the ray runs along +z
+// from the origin, so the test only needs 2D edge functions and neighbouring
+// triangles can never both miss a ray crossing their shared edge.
+//
+struct WatertightRay
+{
+	WatertightRay(const Ray &ray) : origin(ray.p)
+	{
+		// z is the dominant direction axis, x and y keep the winding
+		glm::vec3 magnitude = glm::abs(ray.d);
+		kz = magnitude.x > magnitude.y ? (magnitude.x > magnitude.z ? 0 : 2) : (magnitude.y > magnitude.z ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (ray.d[kz] < 0.0f)
+		{
+			std::swap(kx, ky);
+		}
+		sx = ray.d[kx] / ray.d[kz];
+		sy = ray.d[ky] / ray.d[kz];
+		sz = 1.0f / ray.d[kz];
+	}
+
+	glm::vec3 origin;
+	int kx, ky, kz;
+	float sx, sy, sz;
+};
+
+
+// Watertight test of one ray against the triangles at positions [k, k +
+// PACKET_SIZE) of the mesh's leaf arrays, one triangle per lane.  The
+// vertices are sheared into the ray's frame and the signs of the scaled
+// barycentrics decide a hit before t is divided out.  Returns the lanes that
+// hit in (tmin, tmax), with their ray parameters in t.
+//
+static simd::SimdMask intersectTriangles(const WatertightRay &ray, const Mesh &mesh, int k, simd::SimdMask lanes,
+										 float tmin, float tmax, simd::SimdFloat &t)
+{
+	using namespace simd;
+	SimdVec3 origin(ray.origin);
+	SimdVec3 corner[3];
+	for (int i = 0; i < 3; i++)
+	{
+		corner[i] = SimdVec3(SimdFloat::load(&mesh.leafCorners[i][0][k]), SimdFloat::load(&mesh.leafCorners[i][1][k]),
+							 SimdFloat::load(&mesh.leafCorners[i][2][k])) - origin;
+	}
+	const SimdVec3 &a = corner[0];
+	const SimdVec3 &b = corner[1];
+	const SimdVec3 &c = corner[2];
+	SimdFloat sx(ray.sx);
+	SimdFloat sy(ray.sy);
+
+	SimdFloat ax = a[ray.kx] - sx * a[ray.kz];
+	SimdFloat ay = a[ray.ky] - sy * a[ray.kz];
+	SimdFloat bx = b[ray.kx] - sx * b[ray.kz];
+	SimdFloat by = b[ray.ky] - sy * b[ray.kz];
+	SimdFloat cx = c[ray.kx] - sx * c[ray.kz];
+	SimdFloat cy = c[ray.ky] - sy * c[ray.kz];
+
+	// Scaled barycentric coordinates
+	SimdFloat u = cx * by - cy * bx;
+	SimdFloat v = ax * cy - ay * cx;
+	SimdFloat w = bx * ay - by * ax;
+
+	// Ray exactly on an edge, decide those lanes in double so both triangles
+	// agree.  Rare enough to do lane by lane.
+	SimdFloat zero(0.0f);
+	SimdMask onEdge = lanes & (andNot(u <= zero, u < zero) | andNot(v <= zero, v < zero) | andNot(w <= zero, w < zero));
+	if (onEdge.any())
+	{
+		float laneU[PACKET_SIZE], laneV[PACKET_SIZE], laneW[PACKET_SIZE];
+		u.store(laneU);
+		v.store(laneV);
+		w.store(laneW);
+		for (int i = 0; i < PACKET_SIZE; i++)
+		{
+			if (onEdge.lane(i))
+			{
+				double dax = ax[i], day = ay[i], dbx = bx[i];
+				double dby = by[i], dcx = cx[i], dcy = cy[i];
+				laneU[i] = (float) (dcx * dby - dcy * dbx);
+				laneV[i] = (float) (dax * dcy - day * dcx);
+				laneW[i] = (float) (dbx * day - dby * dax);
+			}
+		}
+		u = SimdFloat::load(laneU);
+		v = SimdFloat::load(laneV);
+		w = SimdFloat::load(laneW);
+	}
+
+	// Either winding hits, mixed signs miss
+	SimdMask negative = (u < zero) | (v < zero) | (w < zero);
+	SimdMask positive = (u > zero) | (v > zero) | (w > zero);
+	SimdMask hit = andNot(lanes, negative & positive);
+	SimdFloat det = u + v + w;
+	hit = andNot(hit, andNot(det <= zero, det < zero));
+	if (!hit.any())
+	{
+		return hit;
+	}
+
+	SimdFloat sz(ray.sz);
+	SimdFloat az = sz * a[ray.kz];
+	SimdFloat bz = sz * b[ray.kz];
+	SimdFloat cz = sz * c[ray.kz];
+	t = (u * az + v * bz + w * cz) / det;
+	return hit & (t > SimdFloat(tmin)) & (t < SimdFloat(tmax));
+}
+
+
+// Parse a face corner "v", "v/vt", "v//vn" or "v/vt/vn".  OBJ indices start
+// at 1, negative ones count back from the last element read.
+//
+static bool parseCorner(const char* &c, int vertexCount, int normalCount, int &vertex, int &normal)
+{
+	// strtol would skip over the line break to the next line
+	if (!isdigit((unsigned char) *c) && *c != '-')
+	{
+		return false;
+	}
+	char* end;
+	long index = strtol(c, &end, 10);
+	if (end == c)
+	{
+		return false;
+	}
+	vertex = index < 0 ? vertexCount + index : index - 1;
+	normal = -1;
+	c = end;
+
+	if (*c == '/')
+	{
+		c++;
+		strtol(c, &end, 10);     // texture coordinates are not used
+		c = end;
+		if (*c == '/')
+		{
+			c++;
+			index = strtol(c, &end, 10);
+			if (end != c)
+			{
+				normal = index < 0 ? normalCount + index : index - 1;
+			}
+			c = end;
+		}
+	}
+	return true;
+}
+
+bool Mesh::load(const std::string &objPath)
+{
+	vertices.clear();
+	normals.clear();
+	indices.clear();
+	normalIndices.clear();
+
+	// Read it all at once, line by line parsing is too slow for big meshes
+	ofBuffer buffer = ofBufferFromFile(objPath);
+	std::string text = buffer.getText();
+	bool allNormals = true;
+	vector<int> faceVertices;
+	vector<int> faceNormals;
+
+	const char* c = text.c_str();
+	while (*c != '\0')
+	{
+		char* end;
+		if (c[0] == 'v' && c[1] == ' ')
+		{
+			glm::vec3 v;
+			v.x = strtof(c + 2, &end);
+			v.y = strtof(end, &end);
+			v.z = strtof(end, &end);
+			vertices.push_back(v);
+			c = end;
+		}
+		else if (c[0] == 'v' && c[1] == 'n' && c[2] == ' ')
+		{
+			glm::vec3 n;
+			n.x = strtof(c + 3, &end);
+			n.y = strtof(end, &end);
+			n.z = strtof(end, &end);
+			normals.push_back(n);
+			c = end;
+		}
+		else if (c[0] == 'f' && c[1] == ' ')
+		{
+			faceVertices.clear();
+			faceNormals.clear();
+			c += 2;
+			int vertex, normal;
+			while (true)
+			{
+				while (*c == ' ' || *c == '\t')
+				{
+					c++;
+				}
+				if (!parseCorner(c, vertices.size(), normals.size(), vertex, normal))
+				{
+					break;
+				}
+				faceVertices.push_back(vertex);
+				faceNormals.push_back(normal);
+			}
+
+			// Fan out from the first corner, skipping faces that point outside
+			// the vertex list
+			bool valid = faceVertices.size() >= 3;
+			for (int k = 0; valid && k < (int) faceVertices.size(); k++)
+			{
+				valid = faceVertices[k] >= 0 && faceVertices[k] < (int) vertices.size();
+				allNormals = allNormals && faceNormals[k] >= 0 && faceNormals[k] < (int) normals.size();
+			}
+			for (int k = 1; valid && k + 1 < (int) faceVertices.size(); k++)
+			{
+				indices.push_back(faceVertices[0]);
+				indices.push_back(faceVertices[k]);
+				indices.push_back(faceVertices[k + 1]);
+				normalIndices.push_back(faceNormals[0]);
+				normalIndices.push_back(faceNormals[k]);
+				normalIndices.push_back(faceNormals[k + 1]);
+			}
+		}
+
+		// On to the next line
+		while (*c != '\0' && *c != '\n')
+		{
+			c++;
+		}
+		if (*c == '\n')
+		{
+			c++;
+		}
+	}
+
+	// Smooth shading only if every corner has a normal
+	if (!allNormals)
+	{
+		normalIndices.clear();
+	}
+
+	vector<AABB> bounds(triangleCount());
+	for (int tri = 0; tri < triangleCount(); tri++)
+	{
+		bounds[tri].grow(vertices[indices[3 * tri]]);
+		bounds[tri].grow(vertices[indices[3 * tri + 1]]);
+		bounds[tri].grow(vertices[indices[3 * tri + 2]]);
+	}
+	bvh.build(bounds, PACKET_SIZE);
+
+	// Lay the corners out in leaf order for intersectTriangles
+	for (int corner = 0; corner < 3; corner++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			vector<float> &lane = leafCorners[corner][axis];
+			lane.assign(bvh.primitiveIndices.size() + PACKET_SIZE, 0.0f);
+			for (int i = 0; i < (int) bvh.primitiveIndices.size(); i++)
+			{
+				lane[i] = vertices[indices[3 * bvh.primitiveIndices[i] + corner]][axis];
+			}
+		}
+	}
+
+	preview.clear();
+	preview.addVertices(vertices);
+	for (int index : indices)
+	{
+		preview.addIndex(index);
+	}
+
+	if (indices.empty())
+	{
+		cout << "Mesh: no faces in " << objPath << endl;
+		return false;
+	}
+	return true;
+}
+
+bool Mesh::intersect(const Ray &ray, float tmin, float tmax, Hit &hit)
+{
+	WatertightRay prepared(ray);
+	float closest = tmax;
+	bool found = false;
+	int tests = 0;
+
+	// Leaf boxes farther than the closest triangle so far are skipped
+	bvh.traverseLeaves(ray.p, ray.d, closest, [&](int first, int count)
+	{
+		for (int k = first; k < first + count; k += PACKET_SIZE)
+		{
+			int lanes = std::min(PACKET_SIZE, first + count - k);
+			simd::SimdFloat t;
+			int bits = intersectTriangles(prepared, *this, k, simd::SimdMask::firstLanes(lanes), tmin, closest, t).bits();
+			tests += lanes;
+			for (int lane = 0; bits != 0; lane++, bits >>= 1)
+			{
+				if ((bits & 1) && t[lane] < closest)
+				{
+					closest = t[lane];
+					hit.primitive = bvh.primitiveIndices[k + lane];
+					found = true;
+				}
+			}
+		}
+		return false;
+	});
+	countStat(STAT_TRIANGLE_TESTS, tests);
+
+	if (found)
+	{
+		hit.t = closest;
+	}
+	return found;
+}
+
+// Any triangle in the way will do for shadows
+//
+bool Mesh::occludes(const Ray &ray, float tmax)
+{
+	WatertightRay prepared(ray);
+	bool blocked = false;
+	int tests = 0;
+	bvh.traverseLeaves(ray.p, ray.d, tmax, [&](int first, int count)
+	{
+		for (int k = first; !blocked && k < first + count; k += PACKET_SIZE)
+		{
+			int lanes = std::min(PACKET_SIZE, first + count - k);
+			simd::SimdFloat t;
+			blocked = intersectTriangles(prepared, *this, k, simd::SimdMask::firstLanes(lanes), 0.0f, tmax, t).any();
+			tests += lanes;
+		}
+		return blocked;
+	});
+	countStat(STAT_TRIANGLE_TESTS, tests);
+	return blocked;
+}
+
+// Face normal, or the vertex normals interpolated across the hit triangle
+// when the file has them
+//
+glm::vec3 Mesh::getNormal(const glm::vec3 &point, const Hit &hit)
+{
+	int tri = hit.primitive;
+	const glm::vec3 &v0 = vertices[indices[3 * tri]];
+	const glm::vec3 &v1 = vertices[indices[3 * tri + 1]];
+	const glm::vec3 &v2 = vertices[indices[3 * tri + 2]];
+	glm::vec3 e1 = v1 - v0;
+	glm::vec3 e2 = v2 - v0;
+	glm::vec3 faceNormal = glm::normalize(glm::cross(e1, e2));
+	if (normalIndices.empty())
+	{
+		return faceNormal;
+	}
+
+	// Barycentric coordinates of the point, found again here since only the
+	// closest hit ever needs them
+	glm::vec3 p = point - v0;
+	float d00 = glm::dot(e1, e1);
+	float d01 = glm::dot(e1, e2);
+	float d11 = glm::dot(e2, e2);
+	float d20 = glm::dot(p, e1);
+	float d21 = glm::dot(p, e2);
+	float denom = d00 * d11 - d01 * d01;
+	if (denom == 0.0f)
+	{
+		return faceNormal;
+	}
+	float b1 = (d11 * d20 - d01 * d21) / denom;
+	float b2 = (d00 * d21 - d01 * d20) / denom;
+	float b0 = 1.0f - b1 - b2;
+
+	glm::vec3 normal = b0 * normals[normalIndices[3 * tri]] + b1 * normals[normalIndices[3 * tri + 1]] +
+		b2 * normals[normalIndices[3 * tri + 2]];
+	float length = glm::length(normal);
+	return length > 0.0f ? normal / length : faceNormal;
+}
+
+bool Mesh::getBounds(AABB &bounds)
+{
+	if (bvh.isEmpty())
+	{
+		return false;
+	}
+	bounds = bvh.bounds();
+	return true;
+}
+
+void Mesh::draw()
+{
+	preview.draw();
+}
@@ -1,17 +1,22 @@
 #include "ofApp.h"
+#include "scene.h"
 #include <cmath>
 #include <iostream>
 #include <string>
 
 #define EPSILON 0.001f
 
+// Fraction of a pixel footprint uv differences are measured over
+#define UV_DIFFERENCE_STEP (1.0f / 16)
+
 
 // Get texture from information
 //
-void SceneObject::getTextureColor(const glm::vec3 &point, ofColor &baseColor, ofColor &specularColor)
+void SceneObject::getTextureColor(const glm::vec3 &point, ofColor &baseColor, ofColor &specularColor,
+								  const glm::vec3 &dPdx, const glm::vec3 &dPdy)
 {
 	// Return the diffuse if texture is not present
-	if (!isTextured)
+	if (!isTextured || texture == nullptr || texture->isEmpty())
 	{
 		baseColor = this->diffuseColor;
 		specularColor = this->specularColor;
@@ -22,225 +27,1408 @@ void SceneObject::getTextureColor(const glm::vec3 &point, ofColor &baseColor, of
 	glm::vec2 uv;
 	this->evaluatePoint(point, uv);
 
-	// Calculate point on image
-	int i = (int) fmod(uv.x * this->texture.getWidth() + 0.5f, this->texture.getWidth());
-	int j = (int) fmod(uv.y * this->texture.getHeight() + 0.5f, this->texture.getHeight()); 
+	// Texels covered by the pixel footprint, from the change in uv across it.
+	// The change is taken over a small step of the footprint and scaled
+	// back up.  A step that small only moves uv by half a repeat where a
+	// seam jumps it by whole repeats, so only then is it taken the short way.
+	// A footprint wide enough to do that without a seam spans more repeats
+	// than the coarsest level covers, and gets that level either way.
+	float footprint = 0.0f;
+	if (dPdx != glm::vec3(0) || dPdy != glm::vec3(0))
+	{
+		glm::vec2 uvx, uvy;
+		this->evaluatePoint(point + dPdx * UV_DIFFERENCE_STEP, uvx);
+		this->evaluatePoint(point + dPdy * UV_DIFFERENCE_STEP, uvy);
+		glm::vec2 size(texture->getWidth(), texture->getHeight());
+		glm::vec2 dx = uvx - uv;
+		glm::vec2 dy = uvy - uv;
+		dx -= glm::round(dx);
+		dy -= glm::round(dy);
+		footprint = std::max(glm::length(dx * size), glm::length(dy * size)) / UV_DIFFERENCE_STEP;
+	}
+	const TextureLevel &level = texture->level(texture->levelFor(footprint));
+
+	// Calculate point on image, wrapping negative coordinates too
+	int i = (int) fmod(uv.x * level.width + 0.5f, (float) level.width);
+	int j = (int) fmod(uv.y * level.height + 0.5f, (float) level.height);
+	i = i < 0 ? i + level.width : i;
+	j = j < 0 ? j + level.height : j;
 
 	// Get color
-	baseColor = this->texture.getColor(i, j);
-	specularColor = this->specular.getColor(i, j);
+	countStat(STAT_TEXTURE_FETCHES);
+	const Texel &texel = level.fetch(i, j);
+	baseColor = ofColor(texel.diffuse[0], texel.diffuse[1], texel.diffuse[2]);
+	specularColor = ofColor(texel.specular[0], texel.specular[1], texel.specular[2]);
+}
+
+// Intersect Ray with Plane, only the part of the plane within width and
+// height of its position counts
+//
+bool Plane::intersect(const Ray &ray, float tmin, float tmax, Hit &hit)
+{
+	countStat(STAT_PLANE_TESTS);
+	float denom = glm::dot(ray.d, normal);
+	if (abs(denom) <= glm::epsilon<float>())
+	{
+		return false;
+	}
+	float dist = glm::dot(position - ray.p, normal) / denom;
+	if (dist <= tmin || dist >= tmax)
+	{
+		return false;
+	}
+
+	bool insidePlane = false;
+	glm::vec3 point = ray.evalPoint(dist);
+	// horizontal
+	//
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0))
+	{
+		insidePlane = abs(point.x - position.x) < width / 2 && abs(point.z - position.z) < height / 2;
+	}
+	// front or back
+	//
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+	{
+		insidePlane = abs(point.x - position.x) < width / 2 && abs(point.y - position.y) < width / 2;
+	}
+	// left or right
+	//
+	else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+	{
+		insidePlane = abs(point.y - position.y) < width / 2 && abs(point.z - position.z) < height / 2;
+	}
+
+	if (insidePlane)
+	{
+		hit.t = dist;
+	}
+	return insidePlane;
+}
+
+// intersect() for a packet.  Planes facing down an axis take the SIMD path,
+// where the dot products with the normal reduce to a single component.
+//
+simd::SimdMask Plane::intersectPacket(const simd::RayPacket &packet, simd::SimdMask lanes, simd::PacketHit &hit)
+{
+	// Axes the rectangle extends along, bounded by width and height like intersect()
+	int axis, uAxis, vAxis;
+	float uHalf = width / 2;
+	float vHalf = height / 2;
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0))
+	{
+		axis = 1; uAxis = 0; vAxis = 2;
+	}
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+	{
+		axis = 2; uAxis = 0; vAxis = 1;
+		vHalf = width / 2;
+	}
+	else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+	{
+		axis = 0; uAxis = 1; vAxis = 2;
+	}
+	else
+	{
+		return SceneObject::intersectPacket(packet, lanes, hit);
+	}
+	countStat(STAT_PLANE_TESTS, lanes.count());
+
+	simd::SimdFloat zero(0.0f);
+	simd::SimdFloat normalAxis(normal[axis]);
+	simd::SimdFloat denom = packet.d[axis] * normalAxis;
+	simd::SimdFloat dist = (simd::SimdFloat(position[axis]) - packet.p[axis]) * normalAxis / denom;
+	lanes = lanes & (simd::abs(denom) > simd::SimdFloat(glm::epsilon<float>())) & (dist > zero) & (dist < hit.t);
+	if (!lanes.any())
+	{
+		return lanes;
+	}
+
+	simd::SimdFloat u = packet.p[uAxis] + dist * packet.d[uAxis];
+	simd::SimdFloat v = packet.p[vAxis] + dist * packet.d[vAxis];
+	lanes = lanes & (simd::abs(u - simd::SimdFloat(position[uAxis])) < simd::SimdFloat(uHalf)) &
+			(simd::abs(v - simd::SimdFloat(position[vAxis])) < simd::SimdFloat(vHalf));
+	hit.t = simd::select(lanes, dist, hit.t);
+	hit.setPrimitive(lanes, -1);
+	return lanes;
+}
+
+// Box around the part of the plane that intersect() accepts, which is
+// flat along the normal axis
+//
+bool Plane::getBounds(AABB &bounds)
+{
+	// Pad so rays grazing the flat side still enter the box
+	glm::vec3 pad(EPSILON);
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0))
+	{
+		glm::vec3 halfSize(width / 2, 0, height / 2);
+		bounds = AABB(position - halfSize - pad, position + halfSize + pad);
+		return true;
+	}
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+	{
+		glm::vec3 halfSize(width / 2, width / 2, 0);
+		bounds = AABB(position - halfSize - pad, position + halfSize + pad);
+		return true;
+	}
+	else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+	{
+		glm::vec3 halfSize(0, width / 2, height / 2);
+		bounds = AABB(position - halfSize - pad, position + halfSize + pad);
+		return true;
+	}
+	return false;
+}
+
+Instance::Instance(std::shared_ptr<SceneObject> object, const glm::mat4 &transform)
+{
+	this->object = object;
+	this->transform = transform;
+	inverse = glm::inverse(transform);
+	normalMatrix = glm::transpose(glm::mat3(inverse));
+	position = glm::vec3(transform * glm::vec4(0, 0, 0, 1));
+	diffuseColor = object->diffuseColor;
+	specularColor = object->specularColor;
+	isTextured = object->isTextured;
+	texture = object->texture;
+}
+
+bool Instance::intersect(const Ray &ray, float tmin, float tmax, Hit &hit)
+{
+	return object->intersect(toObject(ray), tmin, tmax, hit);
+}
+
+bool Instance::occludes(const Ray &ray, float tmax)
+{
+	return object->occludes(toObject(ray), tmax);
+}
+
+glm::vec3 Instance::getNormal(const glm::vec3 &point, const Hit &hit)
+{
+	glm::vec3 localPoint = glm::vec3(inverse * glm::vec4(point, 1.0f));
+	return glm::normalize(normalMatrix * object->getNormal(localPoint, hit));
+}
+
+// World box around the transformed corners of the object box
+//
+bool Instance::getBounds(AABB &bounds)
+{
+	AABB local;
+	if (!object->getBounds(local))
+	{
+		return false;
+	}
+	bounds = AABB();
+	for (int corner = 0; corner < 8; corner++)
+	{
+		glm::vec3 p((corner & 1) ? local.max.x : local.min.x,
+					(corner & 2) ? local.max.y : local.min.y,
+					(corner & 4) ? local.max.z : local.min.z);
+		bounds.grow(glm::vec3(transform * glm::vec4(p, 1.0f)));
+	}
+	return true;
+}
+
+// Texture coordinates are those of the object, so the texture moves with it
+//
+void Instance::evaluatePoint(const glm::vec3 &point, glm::vec2 &uv)
+{
+	object->evaluatePoint(glm::vec3(inverse * glm::vec4(point, 1.0f)), uv);
+}
+
+void Instance::draw()
+{
+	ofPushMatrix();
+	ofMultMatrix(transform);
+	object->draw();
+	ofPopMatrix();
+}
+
+void RenderCam::updateBasis()
+{
+	// Looking along up leaves no right vector, use the world axis furthest
+	// from aim instead so a camera looking straight down still renders
+	right = glm::cross(aim, up);
+	if (glm::dot(right, right) < 1e-8f * glm::dot(aim, aim) * glm::dot(up, up))
+	{
+		glm::vec3 axis = std::abs(aim.x) < std::abs(aim.y) ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+		axis = std::abs(aim.z) < std::min(std::abs(aim.x), std::abs(aim.y)) ? glm::vec3(0, 0, 1) : axis;
+		right = glm::cross(aim, axis);
+	}
+	right = glm::normalize(right);
+	trueUp = glm::cross(right, aim);
+	corner = aim * distance + right * view.min.x + trueUp * view.min.y;
+	across = right * view.width();
+	upward = trueUp * view.height();
+
+	// Only used to draw the view plane
+	view.position = position + aim * distance;
+}
+
+// Phong shading, lambert diffuse and blinn-phong specular are evaluated
+// together so each light sample is shadow tested only once.  With a
+// gbufferIndex the visibility of each sample is recorded for re-shading.
+//
+ofColor ofApp::phong(const glm::vec3 &p, const glm::vec3 &norm, const ofColor diffuse,
+				     const ofColor specular, float power, TraceContext &context,
+				     int gbufferIndex)
+{
+	// Beginning color: (0, 0, 0)
+	ofColor resultColor = ofColor::black;
+
+	// Same for every light sample
+	glm::vec3 normal = glm::normalize(norm);
+	glm::vec3 viewerDirection = glm::normalize(renderCam.position - p);
+	bool record = gbufferIndex >= 0 && bRecordGBuffer;
+
+	// Many lights: shade a few picked in proportion to their estimated
+	// contribution, each weighted by how unlikely its pick was so the sum
+	// stays unbiased.  The picks depend only on the point.
+	if (bUseLightTree)
+	{
+		for (int pick = 0; pick < LIGHT_TREE_PICKS; pick++)
+		{
+			float u = sampleFloat(floatBits(p.x), floatBits(p.y), floatBits(p.z) + pick, RNG_LIGHT_PICK);
+			float probability;
+			int l = lightTree.pick(p, u, probability);
+			if (l >= 0)
+			{
+				shadeLight(resultColor, l, 1.0f / (probability * LIGHT_TREE_PICKS), p, normal, viewerDirection,
+						   diffuse, specular, power, context, nullptr);
+			}
+		}
+		return resultColor;
+	}
+
+	// Iterate over all the lights.  A light culled while recording keeps
+	// clear visibility bits, prepareRender has it traced again if an edit
+	// could bring it over the threshold.
+	float peak = shadingPeak(diffuse, specular);
+	for (int l = 0; l < (int) lights.size(); l++)
+	{
+		if (isLightCulled(l, p, peak))
+		{
+			continue;
+		}
+		uint64_t* visibleBits = record ? &visibility[l][gbufferIndex * visibilityWords[l]] : nullptr;
+		shadeLight(resultColor, l, 1.0f, p, normal, viewerDirection, diffuse, specular, power, context, visibleBits);
+	}
+
+	// Return the sum of color contributions
+	return resultColor;
+}
+
+// Add the unshadowed samples of one light, scaled by weight.  Visibility
+// goes to visibleBits, or to scratch space if it is null.
+//
+void ofApp::shadeLight(ofColor &resultColor, int lightIndex, float weight, const glm::vec3 &p,
+					   const glm::vec3 &normal, const glm::vec3 &viewerDirection, const ofColor &diffuse,
+					   const ofColor &specular, float power, TraceContext &context, uint64_t* visibleBits)
+{
+	Light* light = lights[lightIndex];
+	LightSamples samples = light->getSamples();
+	if (visibleBits == nullptr)
+	{
+		context.visibleScratch.assign((samples.count + 63) / 64, 0);
+		visibleBits = context.visibleScratch.data();
+	}
+	lightVisibility(p, lightIndex, context, visibleBits);
+
+	// Divide by number samples so that more samples does not increase brightness
+	float sampleIntensity = weight * light->renderIntensity / samples.count;
+	for (int k = 0; k < samples.count; k++)
+	{
+		// Skip light calculations if in shade
+		if (visibleBits[k / 64] & (uint64_t(1) << (k % 64)))
+		{
+			glm::vec3 lightPosition(samples.x[k], samples.y[k], samples.z[k]);
+			addLightSample(resultColor, p, normal, viewerDirection, lightPosition,
+						   sampleIntensity, diffuse, specular, power);
+		}
+	}
+}
+
+// Brightest a unit intensity light sample can make a point with these
+// colors, both terms at their peak
+//
+float ofApp::shadingPeak(const ofColor &diffuse, const ofColor &specular)
+{
+	return settings.lambertCoefficient * std::max(diffuse.r, std::max(diffuse.g, diffuse.b)) +
+		std::max(specular.r, std::max(specular.g, specular.b));
+}
+
+// True if the whole light, every sample unshadowed, is bounded below
+// LIGHT_CULL_LEVEL of one output level at p, so it needs no shadow rays at
+// all.  The bound is on the light's total, not its samples one by one, so
+// it holds however the samples end up being accumulated.
+//
+bool ofApp::isLightCulled(int lightIndex, const glm::vec3 &p, float peak)
+{
+	Light* light = lights[lightIndex];
+	if (light->renderIntensity <= 0.0f || light->getSamples().count == 0)
+	{
+		return true;
+	}
+	float distanceSquared = lightBounds[lightIndex].distanceSquared(p);
+	return light->renderIntensity * peak < LIGHT_CULL_LEVEL * distanceSquared;
+}
+
+// Phong shading of a cached first hit, using the recorded shadow tests
+//
+ofColor ofApp::phongCached(int gbufferIndex, float power)
+{
+	const GBufferSample &sample = gbuffer[gbufferIndex];
+	ofColor resultColor = ofColor::black;
+	glm::vec3 normal = glm::normalize(sample.normal);
+	glm::vec3 viewerDirection = glm::normalize(renderCam.position - sample.point);
+
+	for (int l = 0; l < (int) lights.size(); l++)
+	{
+		Light* light = lights[l];
+		LightSamples samples = light->getSamples();
+		const uint64_t* visibleBits = &visibility[l][gbufferIndex * visibilityWords[l]];
+		for (int k = 0; k < samples.count; k++)
+		{
+			if (visibleBits[k / 64] & (uint64_t(1) << (k % 64)))
+			{
+				glm::vec3 lightPosition(samples.x[k], samples.y[k], samples.z[k]);
+				addLightSample(resultColor, sample.point, normal, viewerDirection, lightPosition,
+							   light->renderIntensity / samples.count, sample.baseColor, sample.specularColor, power);
+			}
+		}
+	}
+	return resultColor;
+}
+
+// Lambert plus blinn-phong contribution of one unshadowed light sample
+//
+void ofApp::addLightSample(ofColor &resultColor, const glm::vec3 &p, const glm::vec3 &normal,
+						   const glm::vec3 &viewerDirection, const glm::vec3 &lightPosition,
+						   float intensity, const ofColor &diffuse, const ofColor &specular, float power)
+{
+	glm::vec3 toLight = lightPosition - p;
+	glm::vec3 lightDirection = glm::normalize(toLight);
+	float irradiance = intensity / glm::dot(toLight, toLight);
+
+	// Lambert
+	resultColor += max(0.0f, glm::dot(normal, lightDirection))
+				   * irradiance * diffuse * settings.lambertCoefficient;
+
+	// Normal vectors have length 1, sum of two lengths is 2
+	glm::vec3 bisector = (lightDirection + viewerDirection) / 2.0f;
+	resultColor += glm::pow(max(0.0f, glm::dot(normal, glm::normalize(bisector))), power)
+				   * irradiance * specular;
+}
+
+// Set bit k of visibleBits for every sample k of a light that reaches p.
+// Lights with probes have those traced first.  If they all agree the point
+// is taken to be fully lit or fully shadowed, and only a penumbra, where
+// they disagree, traces the rest.  Every sample keeps its 1 / count
+// weight either way, so the result equals tracing them all whenever the
+// probes are right.
+//
+void ofApp::lightVisibility(const glm::vec3 &p, int lightIndex, TraceContext &context, uint64_t* visibleBits)
+{
+	LightSamples samples = lights[lightIndex]->getSamples();
+	SceneObject* &lastOccluder = context.lastOccluder[lightIndex];
+	auto trace = [&](int k)
+	{
+		glm::vec3 lightPosition(samples.x[k], samples.y[k], samples.z[k]);
+		context.stats.counters[STAT_SHADOW_RAYS]++;
+		bool visible = !isShadow(p, lightPosition, lastOccluder);
+		if (visible)
+		{
+			visibleBits[k / 64] |= uint64_t(1) << (k % 64);
+		}
+		return visible;
+	};
+
+	if (!settings.adaptiveShadows || samples.probeCount == 0)
+	{
+		for (int k = 0; k < samples.count; k++)
+		{
+			trace(k);
+		}
+		return;
+	}
+
+	int visibleProbes = 0;
+	for (int probe = 0; probe < samples.probeCount; probe++)
+	{
+		visibleProbes += trace(samples.probes[probe]);
+	}
+	if (visibleProbes == 0)
+	{
+		return;
+	}
+
+	bool penumbra = visibleProbes < samples.probeCount;
+	for (int k = 0; k < samples.count; k++)
+	{
+		bool isProbe = std::find(samples.probes, samples.probes + samples.probeCount, k) !=
+			samples.probes + samples.probeCount;
+		if (isProbe)
+		{
+			continue;
+		}
+		if (penumbra)
+		{
+			trace(k);
+		}
+		else
+		{
+			visibleBits[k / 64] |= uint64_t(1) << (k % 64);
+		}
+	}
+}
+
+// Shadows, any hit query that stops at the first object between the point
+// and the light.  The object that blocked the previous query for the same
+// light is tried first and updated whenever another blocker is found.
+//
+bool ofApp::isShadow(const glm::vec3 &p, const glm::vec3 &lightPosition, SceneObject* &lastOccluder)
+{
+	// Create new ray from point to light, stopping just short of the light
+	glm::vec3 toLight = lightPosition - p;
+	float lightDistance = glm::length(toLight);
+	toLight /= lightDistance;
+	Ray rayToLight(p + EPSILON * toLight, toLight);
+	float tmax = lightDistance - EPSILON;
+
+	if (lastOccluder != nullptr && lastOccluder->occludes(rayToLight, tmax))
+	{
+		return true;
+	}
+
+	for (SceneObject* obj : unboundedObjects)
+	{
+		if (obj->occludes(rayToLight, tmax))
+		{
+			lastOccluder = obj;
+			return true;
+		}
+	}
+
+	SceneObject* blocker = nullptr;
+	sceneBVH.traverse(rayToLight.p, rayToLight.d, tmax, [&](int prim)
+	{
+		SceneObject* obj = bvhObjects[prim];
+		if (obj != lastOccluder && obj->occludes(rayToLight, tmax))
+		{
+			blocker = obj;
+			return true;
+		}
+		return false;
+	});
+
+	if (blocker != nullptr)
+	{
+		lastOccluder = blocker;
+		return true;
+	}
+	return false;
+}
+
+// Collect the bounded objects of the scene and build the BVH over them
+//
+void ofApp::buildBVH()
+{
+	bvhObjects.clear();
+	unboundedObjects.clear();
+	vector<AABB> bounds;
+	for (SceneObject* obj : scene)
+	{
+		// Lights sit in the scene for drawing but are never hit by rays
+		if (dynamic_cast<Light*>(obj) != nullptr)
+		{
+			continue;
+		}
+
+		AABB box;
+		if (obj->getBounds(box))
+		{
+			bvhObjects.push_back(obj);
+			bounds.push_back(box);
+		}
+		else
+		{
+			unboundedObjects.push_back(obj);
+		}
+	}
+	sceneBVH.build(bounds);
+}
+
+// Find the nearest object along a ray, each test only accepts hits nearer
+// than the best one so far
+//
+SceneObject* ofApp::closestHit(const Ray &ray, Hit &hit)
+{
+	hit.t = FLT_MAX;
+	SceneObject* closestObject = nullptr;
+
+	for (SceneObject* obj : unboundedObjects)
+	{
+		if (obj->intersect(ray, 0.0f, hit.t, hit))
+		{
+			closestObject = obj;
+		}
+	}
+
+	// Boxes farther than the closest hit so far are skipped
+	sceneBVH.traverse(ray.p, ray.d, hit.t, [&](int prim)
+	{
+		SceneObject* obj = bvhObjects[prim];
+		if (obj->intersect(ray, 0.0f, hit.t, hit))
+		{
+			closestObject = obj;
+		}
+		return false;
+	});
+
+	return closestObject;
+}
+
+// closestHit() for a packet of rays, objects[lane] is left null for lanes
+// that hit nothing
+//
+void ofApp::closestHitPacket(const simd::RayPacket &packet, simd::PacketHit &hit, SceneObject* objects[PACKET_SIZE])
+{
+	hit.t = simd::SimdFloat(FLT_MAX);
+	for (int lane = 0; lane < PACKET_SIZE; lane++)
+	{
+		hit.primitive[lane] = -1;
+		objects[lane] = nullptr;
+	}
+
+	auto test = [&](SceneObject* obj, simd::SimdMask lanes)
+	{
+		int bits = obj->intersectPacket(packet, lanes, hit).bits();
+		for (int lane = 0; lane < PACKET_SIZE; lane++)
+		{
+			if ((bits >> lane) & 1)
+			{
+				objects[lane] = obj;
+			}
+		}
+	};
+
+	for (SceneObject* obj : unboundedObjects)
+	{
+		test(obj, packet.active);
+	}
+
+	// A box is skipped once it is behind the closest hit in every lane
+	sceneBVH.traversePacket(packet, hit.t, [&](int prim, simd::SimdMask lanes)
+	{
+		test(bvhObjects[prim], lanes);
+	});
+}
+
+//--------------------------------------------------------------
+// Main raytrace loop, renders the whole image on the calling thread
+// and saves it
+//
+void ofApp::rayTrace(const std::string &fileName)
+{
+	stopRender();
+	renderStart = std::chrono::steady_clock::now();
+	prepareRender(false, false);
+	renderPasses(false, false);
+	updateImage();
+	collectStats(std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count());
+
+	// image.mirror(true, false);
+	saveImage(fileName);
+}
+
+// Start a progressive render in the background, restarting it if one is
+// already running.  update() shows the image as it converges.  A re-shade
+// render starts from the cached first hits of the last render instead of
+// tracing primary rays, and leaves the image at one sample per pixel until
+// the next full render.
+//
+void ofApp::startRender(bool reshade)
+{
+	stopRender();
+	renderStart = std::chrono::steady_clock::now();
+	reshade = prepareRender(true, reshade);
+	bRefining = reshade && settings.samplesPerPixel > 1;
+	bRenderFinished = false;
+	bRendering = true;
+	renderThread = std::thread([this, reshade]()
+	{
+		renderPasses(true, reshade);
+		if (bRenderFinished)
+		{
+			collectStats(std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count());
+		}
+		bRendering = false;
+	});
+}
+
+// Cancel the background render and wait for its threads to leave
+//
+void ofApp::stopRender()
+{
+	if (renderThread.joinable())
+	{
+		bCancelRender = true;
+		renderThread.join();
+		bCancelRender = false;
+	}
+	bRendering = false;
+}
+
+// Light samples, the BVH and the buffers are shared by every render thread,
+// so settle them before any thread starts.  Returns whether the render can
+// re-shade from the G-buffer, which needs every light that moved to fit in
+// the visibility cache.
+//
+bool ofApp::prepareRender(bool progressive, bool reshade)
+{
+	// The render threads read these copies, the gui may change the
+	// parameters while they run
+	settings.phongPower = phongPower;
+	settings.lambertCoefficient = lambertCoefficient;
+	settings.samplesPerPixel = samplesPerPixel;
+	settings.aaThreshold = aaThreshold;
+	settings.adaptiveShadows = adaptiveShadows;
+	settings.heatmapByTime = heatmapByTime;
+
+	lightDirty.assign(lights.size(), false);
+	for (int l = 0; l < (int) lights.size(); l++)
+	{
+		lightDirty[l] = lights[l]->updateSamples();
+		lights[l]->renderIntensity = lights[l]->intensity;
+	}
+	buildBVH();
+	renderCam.updateBasis();
+
+	// Light bounds and, for scenes with many lights, the light tree
+	lightBounds.assign(lights.size(), AABB());
+	vector<float> intensities(lights.size());
+	int litLights = 0;
+	for (int l = 0; l < (int) lights.size(); l++)
+	{
+		LightSamples samples = lights[l]->getSamples();
+		for (int k = 0; k < samples.count; k++)
+		{
+			lightBounds[l].grow(glm::vec3(samples.x[k], samples.y[k], samples.z[k]));
+		}
+		intensities[l] = lights[l]->renderIntensity;
+		litLights += intensities[l] > 0.0f;
+	}
+	bUseLightTree = litLights >= LIGHT_TREE_MIN_LIGHTS;
+	lightTree.build(lightBounds, intensities);
+
+	// Fresh per thread state, nothing cached from the last render
+	traceContexts.assign(numThreads, TraceContext());
+	for (TraceContext &context : traceContexts)
+	{
+		context.lastOccluder.assign(lights.size(), nullptr);
+	}
+
+	if (!image.isAllocated() || image.getWidth() != imageWidth || image.getHeight() != imageHeight)
+	{
+		// Nothing to composite a region render into yet
+		image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
+		image.getPixels().set(0);
+	}
+	else if (image.getImageType() != OF_IMAGE_COLOR)
+	{
+		// A loaded grayscale or alpha image, pixels are written 3 bytes each
+		image.setImageType(OF_IMAGE_COLOR);
+	}
+	int numPixels = imageWidth * imageHeight;
+	accumulation.assign(numPixels, glm::vec3(0.0f));
+	resolved = vector<std::atomic<uint32_t>>(numPixels);
+	sampleCounts.assign(numPixels, 0);
+	lumaSum.assign(numPixels, 0.0f);
+	lumaSquares.assign(numPixels, 0.0f);
+	pixelObject.assign(numPixels, nullptr);
+	pixelEdge.assign(numPixels, 0);
+	pixelCost.assign(costHeatmap ? numPixels : 0, 0.0f);
+
+	// Only interactive renders keep a G-buffer, and only while the
+	// visibility bits stay a reasonable size.  Light tree picks are not
+	// recorded, so those scenes have none.
+	bool fitsCache = !bUseLightTree;
+	for (Light* light : lights)
+	{
+		fitsCache = fitsCache && light->getSamples().count <= MAX_CACHED_LIGHT_SAMPLES;
+	}
+	if (reshade && fitsCache && bGBufferValid && (int) gbuffer.size() == numPixels)
+	{
+		// Dirty lights get cleared bits, their shadow rays are traced again.
+		// So do lights that got brighter, or a higher lambert coefficient,
+		// since points they were culled at may not be culled any more.
+		for (int l = 0; l < (int) lights.size(); l++)
+		{
+			lightDirty[l] = lightDirty[l] || lights[l]->renderIntensity > cullIntensity[l] ||
+				settings.lambertCoefficient > cullLambert[l];
+			if (lightDirty[l])
+			{
+				visibilityWords[l] = (lights[l]->getSamples().count + 63) / 64;
+				visibility[l].assign(numPixels * visibilityWords[l], 0);
+				cullIntensity[l] = lights[l]->renderIntensity;
+				cullLambert[l] = settings.lambertCoefficient;
+			}
+		}
+		return true;
+	}
+
+	bGBufferValid = false;
+	bRecordGBuffer = progressive && fitsCache;
+	gbuffer.assign(bRecordGBuffer ? numPixels : 0, GBufferSample());
+	visibility.assign(lights.size(), vector<uint64_t>());
+	visibilityWords.assign(lights.size(), 0);
+	cullIntensity.assign(lights.size(), 0.0f);
+	cullLambert.assign(lights.size(), 0.0f);
+	for (int l = 0; l < (int) lights.size(); l++)
+	{
+		cullIntensity[l] = lights[l]->renderIntensity;
+		cullLambert[l] = settings.lambertCoefficient;
+	}
+	for (int l = 0; l < (int) lights.size() && bRecordGBuffer; l++)
+	{
+		visibilityWords[l] = (lights[l]->getSamples().count + 63) / 64;
+		visibility[l].assign(numPixels * visibilityWords[l], 0);
+	}
+	return false;
+}
+
+// A progressive render first traces a coarse grid of pixels and fills in the
+// blocks around them, halving the block size each pass until every pixel
+// has one sample.  Later passes give every pixel a few jittered samples,
+// then adaptive passes add more only where pixels are noisy or on an edge,
+// up to samplesPerPixel.  A re-shade render gets the one sample from the
+// G-buffer and stops there, jittered and adaptive samples would all need
+// primary rays again.
+//
+void ofApp::renderPasses(bool progressive, bool reshade)
+{
+	vector<RenderPass> passes;
+	for (int blockSize = progressive ? 16 : 1; blockSize >= 1 && !reshade; blockSize /= 2)
+	{
+		passes.push_back({ blockSize, 0, blockSize == (progressive ? 16 : 1), false });
+	}
+	int baseSamples = reshade ? 1 : std::min(settings.samplesPerPixel, AA_BASE_SAMPLES);
+	for (int sample = 1; sample < baseSamples; sample++)
+	{
+		passes.push_back({ 1, sample, false, false });
+	}
+	int adaptivePasses = reshade ? 0 : (settings.samplesPerPixel - baseSamples + AA_ROUND_SAMPLES - 1) / AA_ROUND_SAMPLES;
+	for (int round = 0; round < adaptivePasses; round++)
+	{
+		passes.push_back({ 1, 0, false, true });
+	}
+
+	// Tiles cover disjoint pixels, so threads can write to the buffers without
+	// locking.  Tiles run in (i, j) with j bottom to top, the region is in
+	// image rows.
+	Tile region = imageRegion();
+	TileScheduler scheduler(Tile { region.x0, imageHeight - region.y1, region.x1, imageHeight - region.y0 });
+	scheduler.selectRange(firstTile, lastTile);
+	if (reshade)
+	{
+		// Visibility of dirty lights is only whole once the pass completes
+		bGBufferValid = false;
+		scheduler.run(numThreads, [this](const Tile &tile, int worker)
+		{
+			threadStats = &traceContexts[worker].stats;
+			reshadeTile(tile, traceContexts[worker]);
+			threadStats = nullptr;
+		});
+		if (bCancelRender)
+		{
+			return;
+		}
+		bGBufferValid = true;
+	}
+
+	for (int p = 0; p < (int) passes.size(); p++)
+	{
+		const RenderPass &pass = passes[p];
+		if (pass.adaptive && (p == 0 || !passes[p - 1].adaptive))
+		{
+			markObjectEdges();
+		}
+		scheduler.run(numThreads, [this, &pass](const Tile &tile, int worker)
+		{
+			threadStats = &traceContexts[worker].stats;
+			renderTile(tile, pass, traceContexts[worker]);
+			threadStats = nullptr;
+		});
+		if (bCancelRender)
+		{
+			return;
+		}
+
+		// Every pixel center has been traced and recorded
+		if (pass.blockSize == 1 && pass.sample == 0 && !pass.adaptive && bRecordGBuffer)
+		{
+			bGBufferValid = true;
+		}
+	}
+	bRenderFinished = true;
 }
 
-// Intersect Ray with Plane (wrapper on glm::intersect*)
+// Render one tile of a pass into the accumulation buffer.  Pixels are
+// gathered into packets of neighbouring primary rays that are traced together.
 //
-bool Plane::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normalAtIntersect)
+void ofApp::renderTile(const Tile &tile, const RenderPass &pass, TraceContext &context)
 {
-	float dist;
-	bool insidePlane = false;
-	bool hit = glm::intersectRayPlane(ray.p, ray.d, position, this->normal, dist);
-	if (hit)
-	{
-		Ray r = ray;
-		point = r.evalPoint(dist);
-		normalAtIntersect = this->normal;
-		glm::vec2 xrange = glm::vec2(position.x - width / 2, position.x + width / 2);
-		glm::vec2 yrange = glm::vec2(position.y - width / 2, position.y + width / 2);
-		glm::vec2 zrange = glm::vec2(position.z - height / 2, position.z + height / 2);
-		// horizontal
-		//
-		if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0))
-		{
-			if (point.x < xrange[1] && point.x > xrange[0] && point.z < zrange[1] && point.z > zrange[0])
-			{
-				insidePlane = true;
-			}
+	int blockSize = pass.blockSize;
+
+	PixelSample packet[PACKET_SIZE];
+	int packetSize = 0;
+
+	// Block corners inside the tile, visited in Morton order so each packet
+	// is a small square of neighbouring rays rather than a strip of a row
+	int jStart = (tile.y0 + blockSize - 1) / blockSize * blockSize;
+	int iStart = (tile.x0 + blockSize - 1) / blockSize * blockSize;
+	uint32_t columns = tile.x1 > iStart ? (tile.x1 - iStart + blockSize - 1) / blockSize : 0;
+	uint32_t rows = tile.y1 > jStart ? (tile.y1 - jStart + blockSize - 1) / blockSize : 0;
+	uint32_t side = 1;
+	while (side < columns || side < rows)
+	{
+		side *= 2;
+	}
+
+	for (uint32_t code = 0; code < side * side; code++)
+	{
+		// Cancel within a tile rather than after it
+		if (code % 256 == 0 && bCancelRender)
+		{
+			return;
+		}
+
+		uint32_t column, row;
+		mortonDecode(code, column, row);
+		if (column >= columns || row >= rows)
+		{
+			continue;
 		}
-		// front or back
-		//
-		else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+		int i = iStart + column * blockSize;
+		int j = jStart + row * blockSize;
+
+		// Adaptive passes add samples after the ones the pixel has, to the
+		// pixels that need them
+		int firstSample = pass.sample;
+		int sampleCount = 1;
+		if (pass.adaptive)
 		{
-			if (point.x < xrange[1] && point.x > xrange[0] && point.y < yrange[1] && point.y > yrange[0])
+			int index = (imageHeight - j - 1) * imageWidth + i;
+			if (!needsSamples(index))
 			{
-				insidePlane = true;
+				continue;
 			}
+			firstSample = sampleCounts[index];
+			sampleCount = std::min(AA_ROUND_SAMPLES, settings.samplesPerPixel - firstSample);
+		}
+
+		// Corners on the grid of the previous pass already hold their sample
+		bool tracedBefore = !pass.firstPass && i % (2 * blockSize) == 0 && j % (2 * blockSize) == 0;
+		if (!pass.adaptive && pass.sample == 0 && tracedBefore)
+		{
+			continue;
 		}
-		// left or right
-		//
-		else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+
+		for (int sample = firstSample; sample < firstSample + sampleCount; sample++)
 		{
-			if (point.y < yrange[1] && point.y > yrange[0] && point.z < zrange[1] && point.z > zrange[0])
+			// First sample goes through the pixel center, later ones are jittered
+			// by numbers that depend only on the pixel and sample
+			float du = sample == 0 ? 0.5f : sampleFloat(i, j, sample, RNG_PIXEL_JITTER_X);
+			float dv = sample == 0 ? 0.5f : sampleFloat(i, j, sample, RNG_PIXEL_JITTER_Y);
+			packet[packetSize++] = { i, j, du, dv, sample };
+			if (packetSize == PACKET_SIZE)
 			{
-				insidePlane = true;
+				tracePacket(packet, packetSize, pass, context);
+				packetSize = 0;
 			}
 		}
 	}
-	return insidePlane;
+
+	if (packetSize > 0)
+	{
+		tracePacket(packet, packetSize, pass, context);
+	}
 }
 
-// Convert (u, v) to (x, y, z) 
-// We assume u,v is in [0, 1]
+// Trace up to PACKET_SIZE primary rays together and shade each hit
 //
-glm::vec3 ViewPlane::toWorld(float u, float v)
+void ofApp::tracePacket(const PixelSample* samples, int count, const RenderPass &pass, TraceContext &context)
 {
-	float w = width();
-	float h = height();
-	return (glm::vec3((u * w) + min.x, (v * h) + min.y, position.z));
+	// Directions are linear in (u, v), so the whole packet takes a few
+	// multiply adds and one rsqrt to normalize
+	float u[PACKET_SIZE];
+	float v[PACKET_SIZE];
+	for (int lane = 0; lane < PACKET_SIZE; lane++)
+	{
+		// Unused lanes repeat the first ray, they are masked off anyway
+		const PixelSample &pixel = samples[lane < count ? lane : 0];
+		u[lane] = (pixel.i + pixel.du) / imageWidth;
+		v[lane] = (pixel.j + pixel.dv) / imageHeight;
+	}
+	simd::SimdFloat packetU = simd::SimdFloat::load(u);
+	simd::SimdFloat packetV = simd::SimdFloat::load(v);
+
+	simd::RayPacket packet;
+	simd::SimdVec3 direction;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		direction[axis] = simd::SimdFloat(renderCam.corner[axis]) + packetU * simd::SimdFloat(renderCam.across[axis]) +
+			packetV * simd::SimdFloat(renderCam.upward[axis]);
+	}
+	simd::SimdFloat inverseLength = simd::rsqrt(simd::dot(direction, direction));
+	for (int axis = 0; axis < 3; axis++)
+	{
+		packet.p[axis] = simd::SimdFloat(renderCam.position[axis]);
+		packet.d[axis] = direction[axis] * inverseLength;
+		packet.invD[axis] = simd::SimdFloat(1.0f) / packet.d[axis];
+	}
+	context.stats.counters[STAT_PRIMARY_RAYS] += count;
+
+	// Scalar rays for shading, with their differentials
+	Ray rays[PACKET_SIZE];
+	float lengths[PACKET_SIZE];
+	inverseLength.store(lengths);
+	for (int lane = 0; lane < count; lane++)
+	{
+		rays[lane] = Ray(packet.origin(lane), packet.direction(lane));
+		renderCam.setDifferentials(rays[lane], 1.0f / lengths[lane], 1.0f / imageWidth, 1.0f / imageHeight);
+	}
+
+	packet.active = simd::SimdMask::firstLanes(count);
+
+	// Lanes share the cost of the packet's closest hit search
+	bool measureCost = !pixelCost.empty();
+	double costBefore = measureCost ? costMeter(context) : 0;
+	simd::PacketHit packetHit;
+	SceneObject* objects[PACKET_SIZE];
+	{
+		ScopedTimer timer(TIMER_PRIMARY, &context.stats);
+		closestHitPacket(packet, packetHit, objects);
+	}
+	double primaryCost = measureCost ? (costMeter(context) - costBefore) / count : 0;
+
+	ScopedTimer timer(TIMER_SHADING, &context.stats);
+	float t[PACKET_SIZE];
+	packetHit.t.store(t);
+	for (int lane = 0; lane < count; lane++)
+	{
+		const PixelSample &pixel = samples[lane];
+
+		// Only the pixel center sample is recorded
+		int gbufferIndex = -1;
+		if (pixel.sample == 0 && bRecordGBuffer)
+		{
+			gbufferIndex = (imageHeight - pixel.j - 1) * imageWidth + pixel.i;
+		}
+
+		Hit hit;
+		hit.t = t[lane];
+		hit.primitive = packetHit.primitive[lane];
+		costBefore = measureCost ? costMeter(context) : 0;
+		ofColor color = shadeHit(rays[lane], objects[lane], hit, context, gbufferIndex);
+		storeSample(pixel, color, objects[lane], pass);
+		if (measureCost)
+		{
+			pixelCost[(imageHeight - pixel.j - 1) * imageWidth + pixel.i] +=
+				primaryCost + costMeter(context) - costBefore;
+		}
+	}
 }
 
-// Get a ray from the current camera position to the (u, v) position on
-// the ViewPlane
+// Running total of the work done on a thread, in the heatmap's unit
 //
-Ray RenderCam::getRay(float u, float v)
+double ofApp::costMeter(const TraceContext &context)
 {
-	glm::vec3 pointOnPlane = view.toWorld(u, v);
-	return(Ray(position, glm::normalize(pointOnPlane - position)));
+	if (settings.heatmapByTime)
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	const uint64_t* counters = context.stats.counters;
+	return (double) (counters[STAT_SPHERE_TESTS] + counters[STAT_PLANE_TESTS] + counters[STAT_TRIANGLE_TESTS]);
 }
 
-// Lambert shading
+// Add a traced sample to the accumulation buffer
 //
-ofColor ofApp::lambert(const glm::vec3 &p, const glm::vec3 &norm, const ofColor diffuse)
+void ofApp::storeSample(const PixelSample &pixel, const ofColor &color, SceneObject* object, const RenderPass &pass)
 {
-	// Beginning color: (0, 0, 0)
-	ofColor resultColor = ofColor::black;
+	// Image rows run top to bottom, v runs bottom to top
+	int index = (imageHeight - pixel.j - 1) * imageWidth + pixel.i;
+	glm::vec3 sample(color.r, color.g, color.b);
+	float luma = 0.299f * color.r + 0.587f * color.g + 0.114f * color.b;
 
-	// Iterate over all the lights
-	for (Light* light : lights)
+	if (pixel.sample > 0)
 	{
-		// Skip light calculations if in shade
-		vector<Ray> lightRays;
-		int numSamples = light->getRaySamples(p, lightRays);
-		for (Ray lightRay : lightRays)
+		accumulation[index] += sample;
+		sampleCounts[index]++;
+		lumaSum[index] += luma;
+		lumaSquares[index] += luma * luma;
+		if (object != pixelObject[index])
 		{
-			// Calculate shadows
-			if (!isShadow(p, lightRay))
-			{
-				resultColor += max(0.0f, glm::dot(glm::normalize(norm), glm::normalize(-lightRay.d)))
-						       * light->intensity / pow(glm::length(lightRay.d), 2) / numSamples
-						       * diffuse * lambertCoefficient;	
-			}
+			pixelEdge[index] = 1;
 		}
+		publishPixel(index);
+		return;
 	}
 
-	// Return the sum of color contributions
-	return resultColor;
+	// Fill the block this pixel stands for until finer passes reach it
+	for (int y = pixel.j; y < std::min(pixel.j + pass.blockSize, imageHeight); y++)
+	{
+		for (int x = pixel.i; x < std::min(pixel.i + pass.blockSize, imageWidth); x++)
+		{
+			int blockIndex = (imageHeight - y - 1) * imageWidth + x;
+			accumulation[blockIndex] = sample;
+			sampleCounts[blockIndex] = 1;
+			lumaSum[blockIndex] = luma;
+			lumaSquares[blockIndex] = luma * luma;
+			pixelObject[blockIndex] = object;
+			publishPixel(blockIndex);
+		}
+	}
 }
 
-// Phong shading
-ofColor ofApp::phong(const glm::vec3 &p, const glm::vec3 &norm, const ofColor diffuse,
-				     const ofColor specular, float power)
+// Publish the mean of a pixel's samples for the preview, which reads it
+// while render threads are still writing the accumulation buffer
+//
+void ofApp::publishPixel(int index)
 {
-	// Beginning color: (0, 0, 0)
-	ofColor resultColor = ofColor::black;
+	glm::vec3 color = accumulation[index] / (float) sampleCounts[index];
+	uint32_t packed = PIXEL_RESOLVED | ((uint32_t) color.x << 16) | ((uint32_t) color.y << 8) | (uint32_t) color.z;
+	resolved[index].store(packed, std::memory_order_relaxed);
+}
 
-	// Iterate over all the lights
-	for (Light* light : lights)
+// Mark pixels whose center hit a different object than a neighbour's, or
+// whose mean luminance is far from a neighbour's, such as along shadow
+// edges and highlights that a few samples can agree on by chance.  Runs
+// between passes, so reading the neighbours races with no thread.
+// Neighbours without samples, outside the region, are left out.
+//
+void ofApp::markObjectEdges()
+{
+	for (int y = 0; y < imageHeight; y++)
 	{
-		// Skip light calculations if in shade
-		vector<Ray> lightRays;
-		int numSamples = light->getRaySamples(p, lightRays);
-		for (Ray lightRay : lightRays)
+		for (int x = 0; x < imageWidth; x++)
 		{
-			// Calculate shadows
-			if (!isShadow(p, lightRay))
+			int index = y * imageWidth + x;
+			if (sampleCounts[index] == 0)
+			{
+				continue;
+			}
+			int neighbours[4] = { x > 0 ? index - 1 : -1, x + 1 < imageWidth ? index + 1 : -1,
+								  y > 0 ? index - imageWidth : -1, y + 1 < imageHeight ? index + imageWidth : -1 };
+			for (int neighbour : neighbours)
 			{
-				glm::vec3 viewerDirection = renderCam.position - p;
-
-				// Normal vectors have length 1, sum of two lengths is 2
-				glm::vec3 bisector = (glm::normalize(-lightRay.d) + glm::normalize(viewerDirection)) / 2.0f;
-				
-				// Divide by number samples so that more samples does not increase brightness
-				resultColor += glm::pow(max(0.0f, glm::dot(glm::normalize(norm), glm::normalize(bisector))), power)
-							   * light->intensity / pow(glm::length(lightRay.d), 2) / numSamples
-							   * specular;
+				if (neighbour < 0 || sampleCounts[neighbour] == 0)
+				{
+					continue;
+				}
+				float contrast = lumaSum[neighbour] / sampleCounts[neighbour] - lumaSum[index] / sampleCounts[index];
+				if (pixelObject[neighbour] != pixelObject[index] || std::abs(contrast) > AA_EDGE_CONTRAST)
+				{
+					pixelEdge[index] = 1;
+				}
 			}
 		}
 	}
-
-	// Return the sum of phong colors added to lambert
-	return resultColor + lambert(p, norm, diffuse);
 }
 
-// Shadows
-bool ofApp::isShadow(const glm::vec3 &p, const Ray &lightRay)
+// Whether an adaptive pass should add samples to a pixel: it is on an
+// object edge, or the standard error of its luminance is above aaThreshold
+//
+bool ofApp::needsSamples(int index)
 {
-	// Create new ray from point to light
-	Ray rayToLight(p + EPSILON * glm::normalize(-lightRay.d), glm::normalize(-lightRay.d));
-
-	glm::vec3 tempPoint(0.0f, 0.0f, 0.0f);
-	glm::vec3 tempNormal(0.0f, 0.0f, 0.0f);
-
-	for (SceneObject* obj : scene)
+	int count = sampleCounts[index];
+	if (count >= settings.samplesPerPixel || count == 0)
 	{
-		// If the intersecting object is closer
-		if (obj->intersect(rayToLight, tempPoint, tempNormal) &&
-			glm::length(tempPoint - p) < glm::length(lightRay.p - p))
-		{
-			return true;
-		}
+		return false;
 	}
-	return false;
+	if (pixelEdge[index])
+	{
+		return true;
+	}
+	if (count < 2)
+	{
+		return false;
+	}
+	float mean = lumaSum[index] / count;
+	float variance = std::max(0.0f, (lumaSquares[index] - mean * lumaSum[index]) / (count - 1));
+	return variance / count > settings.aaThreshold * settings.aaThreshold;
 }
 
-//--------------------------------------------------------------
-// Main raytrace loop
+// Re-shade one tile from the G-buffer.  Only lights whose samples moved
+// trace their shadow rays again.
 //
-void ofApp::rayTrace()
+void ofApp::reshadeTile(const Tile &tile, TraceContext &context)
 {
-	image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
-	for (int i = 0; i < imageWidth; i++)
+	ScopedTimer timer(TIMER_SHADING, &context.stats);
+	for (int j = tile.y0; j < tile.y1; j++)
 	{
-		for (int j = 0; j < imageHeight; j++)
+		if (bCancelRender)
 		{
-			float u = (i + 0.5) / imageWidth;
-			float v = (j + 0.5) / imageHeight;
-
-			Ray ray = renderCam.getRay(u, v);
-			
-			// High enough to be large, small enough to plug into evalPoint
-			float distance = 10000.0;
-			SceneObject* closestObject = nullptr;
+			return;
+		}
 
-			// Fpr lighting purposes
-			glm::vec3 maxPoint;
-			glm::vec3 maxNormal;
+		for (int i = tile.x0; i < tile.x1; i++)
+		{
+			int index = (imageHeight - j - 1) * imageWidth + i;
+			const GBufferSample &sample = gbuffer[index];
 
-			for (SceneObject* obj : scene)
+			ofColor color = backgroundColor;
+			double costBefore = pixelCost.empty() ? 0 : costMeter(context);
+			if (sample.object != nullptr)
 			{
-				glm::vec3 point;
-				glm::vec3 normal;
-				if (obj->intersect(ray, point, normal))
+				float peak = shadingPeak(sample.baseColor, sample.specularColor);
+				for (int l = 0; l < (int) lights.size(); l++)
 				{
-					// Only need to compare one coordinate
-					if (abs(ray.evalPoint(distance).x - ray.p.x) > abs(point.x - ray.p.x))
+					if (!lightDirty[l] || isLightCulled(l, sample.point, peak))
 					{
-						distance = glm::length(point - ray.p);
-						closestObject = obj;
-						maxPoint = point;
-						maxNormal = normal;
+						continue;
 					}
-
+					lightVisibility(sample.point, l, context, &visibility[l][index * visibilityWords[l]]);
 				}
+				color = phongCached(index, settings.phongPower);
 			}
-			// Draw on image
-			if (closestObject != nullptr)
+			accumulation[index] = glm::vec3(color.r, color.g, color.b);
+			sampleCounts[index] = 1;
+			publishPixel(index);
+			float luma = 0.299f * color.r + 0.587f * color.g + 0.114f * color.b;
+			lumaSum[index] = luma;
+			lumaSquares[index] = luma * luma;
+			pixelObject[index] = sample.object;
+			if (!pixelCost.empty())
 			{
-				// Get color
-				ofColor baseColor;
-				ofColor specularColor;
-				closestObject->getTextureColor(maxPoint, baseColor, specularColor);
-
-				// Calculate raytraced color
-				ofColor phongColor = phong(maxPoint, maxNormal, baseColor, specularColor, phongPower);
-				image.setColor(i, imageHeight - j - 1, phongColor);
+				pixelCost[index] += costMeter(context) - costBefore;
 			}
-			else
+		}
+	}
+}
+
+// Shade the closest hit of a primary ray, object is null if it hit nothing
+//
+ofColor ofApp::shadeHit(const Ray &ray, SceneObject* closestObject, const Hit &hit, TraceContext &context,
+						int gbufferIndex)
+{
+	if (closestObject == nullptr)
+	{
+		return backgroundColor;
+	}
+
+	// For lighting purposes
+	glm::vec3 maxPoint = ray.evalPoint(hit.t);
+	glm::vec3 maxNormal = closestObject->getNormal(maxPoint, hit);
+
+	// Footprint of the pixel on the surface, the differentials carried to
+	// the hit and projected onto the tangent plane
+	glm::vec3 dPdx = hit.t * ray.dDdx;
+	glm::vec3 dPdy = hit.t * ray.dDdy;
+	float cosine = glm::dot(ray.d, maxNormal);
+	if (abs(cosine) > EPSILON)
+	{
+		dPdx -= ray.d * (glm::dot(dPdx, maxNormal) / cosine);
+		dPdy -= ray.d * (glm::dot(dPdy, maxNormal) / cosine);
+	}
+
+	// Get color
+	ofColor baseColor;
+	ofColor specularColor;
+	closestObject->getTextureColor(maxPoint, baseColor, specularColor, dPdx, dPdy);
+
+	// Keep the hit for re-shading, background pixels leave the object empty
+	if (gbufferIndex >= 0)
+	{
+		GBufferSample &sample = gbuffer[gbufferIndex];
+		sample.object = closestObject;
+		sample.point = maxPoint;
+		sample.normal = maxNormal;
+		sample.baseColor = baseColor;
+		sample.specularColor = specularColor;
+	}
+
+	// Calculate raytraced color
+	return phong(maxPoint, maxNormal, baseColor, specularColor, settings.phongPower, context, gbufferIndex);
+}
+
+// Copy the colors the render threads have published into the displayed
+// image.  Each pixel is one atomic word, so this can run while they work.
+//
+void ofApp::updateImage()
+{
+	unsigned char* pixels = image.getPixels().getData();
+	Tile region = imageRegion();
+	for (int y = region.y0; y < region.y1; y++)
+	{
+		for (int index = y * imageWidth + region.x0; index < y * imageWidth + region.x1; index++)
+		{
+			// Pixels of tiles outside the tile range have no samples, keep them
+			uint32_t packed = resolved[index].load(std::memory_order_relaxed);
+			if (!(packed & PIXEL_RESOLVED))
 			{
-				image.setColor(i, imageHeight - j - 1, backgroundColor);
+				continue;
 			}
+			pixels[3 * index] = (packed >> 16) & 0xFF;
+			pixels[3 * index + 1] = (packed >> 8) & 0xFF;
+			pixels[3 * index + 2] = packed & 0xFF;
 		}
 	}
-	// image.mirror(true, false);
-	image.save(ofToDataPath("image.jpg"));
+}
+
+// Sum the counters and timers of every render thread
+//
+void ofApp::collectStats(double wallSeconds)
+{
+	renderStats = RenderStats();
+	for (const TraceContext &context : traceContexts)
+	{
+		renderStats.add(context.stats);
+	}
+	renderStats.wallSeconds = wallSeconds;
+}
+
+// Save the finished image, then report the render's stats in the stats
+// panel and as JSON in a file next to the image
+//
+void ofApp::saveImage(const std::string &fileName)
+{
+	{
+		ScopedTimer timer(TIMER_SAVE, &renderStats);
+		image.save(ofToDataPath(fileName));
+	}
+
+	raysPerSecondLabel = ofToString(renderStats.raysPerSecond(), 0);
+	refiningLabel = bRefining ? "1 sample, r to refine" : "no";
+	for (int c = 0; c < STAT_COUNTERS; c++)
+	{
+		counterLabels[c] = ofToString(renderStats.counters[c]);
+	}
+	for (int t = 0; t < STAT_TIMERS; t++)
+	{
+		timerLabels[t] = ofToString(renderStats.seconds[t], 3);
+	}
+
+	// Cost per pixel at the heatmap's full color
+	std::string heatmapUnit = settings.heatmapByTime ? "us" : "tests";
+	float heatmapScale = 0;
+	if (!pixelCost.empty())
+	{
+		heatmapScale = saveHeatmap(fileName);
+	}
+	heatmapScaleLabel = pixelCost.empty() ? "" : ofToString(heatmapScale) + " " + heatmapUnit;
+
+	std::string statsFile = fileName.substr(0, fileName.find_last_of('.')) + "_stats.json";
+	ofstream out(ofToDataPath(statsFile));
+	out << "{\"image\": \"" << fileName << "\", \"width\": " << imageWidth << ", \"height\": " << imageHeight
+		<< ", \"samples\": " << settings.samplesPerPixel << ", \"threads\": " << numThreads;
+	if (!pixelCost.empty())
+	{
+		out << ", \"heatmap_scale\": " << heatmapScale << ", \"heatmap_unit\": \"" << heatmapUnit << "\"";
+	}
+	out << ", \"stats\": " << renderStats.toJson() << "}" << endl;
+}
+
+// False color ramp from black through purple, red and orange to pale
+// yellow, x in [0, 1]
+//
+static ofColor heatColor(float x)
+{
+	static const ofColor stops[] = {
+		ofColor(0, 0, 0), ofColor(90, 0, 160), ofColor(220, 40, 40), ofColor(255, 170, 0), ofColor(255, 255, 200)
+	};
+	const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+	float position = ofClamp(x, 0.0f, 1.0f) * last;
+	int stop = std::min((int) position, last - 1);
+	return stops[stop].getLerped(stops[stop + 1], position - stop);
+}
+
+// Save the pixel costs as <image>_heatmap with the image's extension.  The
+// ramp tops out at the 99th percentile so a few outliers do not wash out
+// the rest.  Returns the cost shown at full color.
+//
+float ofApp::saveHeatmap(const std::string &fileName)
+{
+	vector<float> costs;
+	for (float cost : pixelCost)
+	{
+		if (cost > 0)
+		{
+			costs.push_back(cost);
+		}
+	}
+	float scale = 1.0f;
+	if (!costs.empty())
+	{
+		auto percentile = costs.begin() + (costs.size() - 1) * 99 / 100;
+		std::nth_element(costs.begin(), percentile, costs.end());
+		scale = *percentile;
+	}
+
+	ofPixels heatmap;
+	heatmap.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
+	for (int y = 0; y < imageHeight; y++)
+	{
+		for (int x = 0; x < imageWidth; x++)
+		{
+			heatmap.setColor(x, y, heatColor(pixelCost[y * imageWidth + x] / scale));
+		}
+	}
+
+	size_t dot = fileName.find_last_of('.');
+	std::string extension = dot == std::string::npos ? ".jpg" : fileName.substr(dot);
+	ofSaveImage(heatmap, ofToDataPath(fileName.substr(0, dot) + "_heatmap" + extension));
+	return scale;
+}
+
+// Render region clipped to the image, the whole image if it is empty
+//
+Tile ofApp::imageRegion()
+{
+	Tile region = { std::max(renderRegion.x0, 0), std::max(renderRegion.y0, 0),
+					std::min(renderRegion.x1, imageWidth), std::min(renderRegion.y1, imageHeight) };
+	if (region.x1 <= region.x0 || region.y1 <= region.y0)
+	{
+		return { 0, 0, imageWidth, imageHeight };
+	}
+	return region;
+}
+
+// Corners may come in any order.  The G-buffer only holds the pixels of
+// the last region, so the next render traces its first hits again.
+//
+void ofApp::setRenderRegion(const Tile &region)
+{
+	renderRegion = { std::min(region.x0, region.x1), std::min(region.y0, region.y1),
+					 std::max(region.x0, region.x1), std::max(region.y0, region.y1) };
+	bGBufferValid = false;
+	bRestartRender = true;
+	bLightingOnly = false;
+}
+
+// Gui parameters that only change shading of the hits already found,
+// the light panels and the shading coefficients
+//
+static bool isLightingParameter(const std::string &name)
+{
+	static const vector<std::string> lightingNames = {
+		"Phong Power", "Lambert Coefficient", "Position", "Intensity", "Width", "Height",
+		"Width Subdivisions", "Height Subdivisions", "Number of Samples"
+	};
+	return std::find(lightingNames.begin(), lightingNames.end(), name) != lightingNames.end();
+}
+
+// Any gui change invalidates the render in progress, lighting changes can
+// be re-shaded from the G-buffer
+//
+void ofApp::renderSettingChanged(ofAbstractParameter &parameter)
+{
+	bRestartRender = true;
+	if (!isLightingParameter(parameter.getName()))
+	{
+		bLightingOnly = false;
+	}
 }
 
 //--------------------------------------------------------------
@@ -264,6 +1452,64 @@ void ofApp::setup()
 	// Set default camera
 	theCam = &mainCam;
 
+	// Scene objects and lights
+	setupScene();
+
+	// Gui
+	gui.setup();
+	gui.add(phongPower.set("Phong Power", this->phongPower, 1.0f, 100.0f));
+	gui.add(lambertCoefficient.set("Lambert Coefficient", this->lambertCoefficient, 0.0f, 2.0f));
+	gui.add(samplesPerPixel.set("Samples Per Pixel", this->samplesPerPixel, 1, 64));
+	gui.add(aaThreshold.set("AA Threshold", this->aaThreshold, 0.1f, 20.0f));
+	gui.add(adaptiveShadows.set("Adaptive Shadows", this->adaptiveShadows));
+	gui.add(costHeatmap.set("Cost Heatmap", this->costHeatmap));
+	gui.add(heatmapByTime.set("Heatmap By Time", this->heatmapByTime));
+
+	// Add individual light guis to main gui
+	int numLights = 1;
+	for (Light* light : lights)
+	{
+		gui.add(light->gui.setup("Light" + std::to_string(numLights)));
+		light->setupGui();
+		numLights++;
+	}
+
+	// Stats of the last render, filled in when it is saved
+	statsGui.setup("Render Stats");
+	statsGui.setPosition(ofGetWidth() - 230, 10);
+	statsGui.add(raysPerSecondLabel.setup("rays_per_second", ""));
+	statsGui.add(refiningLabel.setup("refining", ""));
+	statsGui.add(heatmapScaleLabel.setup("heatmap_scale", ""));
+	for (int c = 0; c < STAT_COUNTERS; c++)
+	{
+		statsGui.add(counterLabels[c].setup(RenderStats::counterName(c), ""));
+	}
+	for (int t = 0; t < STAT_TIMERS; t++)
+	{
+		statsGui.add(timerLabels[t].setup(RenderStats::timerName(t), ""));
+	}
+
+	// Light panels are nested in the main group, so this hears them too
+	ofAddListener(gui.getParameter().castGroup().parameterChangedE(), this, &ofApp::renderSettingChanged);
+}
+
+//--------------------------------------------------------------
+// Build the scene and lights, needs no window or GL context so the
+// headless renderer can use it too
+//
+void ofApp::setupScene()
+{
+	if (!sceneFile.empty())
+	{
+		SceneFile file;
+		if (file.load(sceneFile))
+		{
+			file.build(*this);
+			return;
+		}
+		cout << "Falling back to the built in scene" << endl;
+	}
+
 	// Add spheres
 	Sphere* s1 = new Sphere(glm::vec3(2, 2.5, -5), 2.0, ofColor::darkSlateGray);
 	Sphere* s2 = new Sphere(glm::vec3(-0.5, 2, -2.5), 1.5, ofColor::gray);
@@ -293,33 +1539,50 @@ void ofApp::setup()
 
 	AreaLight* a1 = new AreaLight(glm::vec3(0.0f, 20.0f, 0.0f), 300.0f, 10.0f, 10.0f, 5, 5, 1);
 
-	scene.push_back(l2);
-	scene.push_back(l3);
-	scene.push_back(a1);
+	addLight(l2);
+	addLight(l3);
+	addLight(a1);
+}
 
-	lights.push_back(l2);
-	lights.push_back(l3);
-	lights.push_back(a1);
+// Add a light to the scene, keyed by its index so it samples the same way
+// however many scenes were built before
+//
+void ofApp::addLight(Light* light)
+{
+	light->sampleSeed = lights.size();
+	scene.push_back(light);
+	lights.push_back(light);
+}
 
-	// Gui
-	gui.setup();
-	gui.add(phongPower.set("Phong Power", this->phongPower, 1.0f, 100.0f));
-	gui.add(lambertCoefficient.set("Lambert Coefficient", this->lambertCoefficient, 0.0f, 2.0f));
+//--------------------------------------------------------------
+void ofApp::update()
+{
+	// Restart a render that has been started once, so edits show up live.
+	// Lighting edits re-shade the cached first hits instead of tracing them.
+	if (bRestartRender && renderThread.joinable())
+	{
+		startRender(bLightingOnly && bGBufferValid);
+	}
+	bRestartRender = false;
+	bLightingOnly = true;
 
-	// Add individual light guis to main gui
-	int numLights = 1;
-	for (Light* light : lights)
+	if (bRendering || bRenderFinished)
 	{
-		gui.add(light->gui.setup("Light" + std::to_string(numLights)));
-		light->setupGui();
-		numLights++;
+		updateImage();
+	}
+
+	// Save once the background render has converged
+	if (bRenderFinished && !bRendering)
+	{
+		bRenderFinished = false;
+		saveImage("image.jpg");
 	}
 }
 
 //--------------------------------------------------------------
-void ofApp::update()
+void ofApp::exit()
 {
-	
+	stopRender();
 }
 
 //--------------------------------------------------------------
@@ -340,6 +1603,21 @@ void ofApp::draw()
 		ofSetColor(ofColor::white);
 		image.update();
 		image.draw(0.0f, 0.0f);
+
+		// Outline the region being dragged, or the one being rendered
+		Tile region = renderRegion;
+		if (bSelectingRegion)
+		{
+			region = { (int) std::min(dragStart.x, dragEnd.x), (int) std::min(dragStart.y, dragEnd.y),
+					   (int) std::max(dragStart.x, dragEnd.x), (int) std::max(dragStart.y, dragEnd.y) };
+		}
+		if (region.x1 > region.x0 && region.y1 > region.y0)
+		{
+			ofNoFill();
+			ofSetColor(ofColor::yellow);
+			ofDrawRectangle(region.x0, region.y0, region.x1 - region.x0, region.y1 - region.y0);
+			ofFill();
+		}
 		ofEnableDepthTest();
 	}
 	// Draw Gui
@@ -349,6 +1627,7 @@ void ofApp::draw()
 
 		// Draw main gui
         gui.draw();
+        statsGui.draw();
 
         ofEnableDepthTest();
     }
@@ -361,7 +1640,8 @@ void ofApp::keyPressed(int key)
 	{
 		case 'r':
 		{
-			rayTrace();
+			startRender();
+			bDrawImage = true;
 			break;
 		}
 		case 'd':
@@ -373,6 +1653,12 @@ void ofApp::keyPressed(int key)
 			}
 			break;
 		}
+		case 'c':
+		{
+			// Back to rendering the whole image
+			setRenderRegion({ 0, 0, 0, 0 });
+			break;
+		}
 		case 'h':
         {
             hideGui = !hideGui;
@@ -415,19 +1701,46 @@ void ofApp::mouseMoved(int x, int y)
 //--------------------------------------------------------------
 void ofApp::mouseDragged(int x, int y, int button)
 {
-
+	if (bSelectingRegion)
+	{
+		dragEnd = glm::vec2(x, y);
+	}
 }
 
 //--------------------------------------------------------------
+// Dragging over the displayed image selects the region to render, the
+// image is drawn at the window origin one pixel to a pixel
+//
 void ofApp::mousePressed(int x, int y, int button)
 {
-
+	// Shift drags select a region, so clicks on the panels drawn over the
+	// image still reach them
+	bool overGui = !hideGui && (gui.getShape().inside(x, y) || statsGui.getShape().inside(x, y));
+	if (bDrawImage && button == OF_MOUSE_BUTTON_LEFT && ofGetKeyPressed(OF_KEY_SHIFT) && !overGui
+		&& x < imageWidth && y < imageHeight)
+	{
+		bSelectingRegion = true;
+		dragStart = dragEnd = glm::vec2(x, y);
+		mainCam.disableMouseInput();
+	}
 }
 
 //--------------------------------------------------------------
 void ofApp::mouseReleased(int x, int y, int button)
 {
+	if (!bSelectingRegion)
+	{
+		return;
+	}
+	bSelectingRegion = false;
+	mainCam.enableMouseInput();
 
+	// A click without a drag is not a region
+	dragEnd = glm::vec2(x, y);
+	if (glm::abs(dragEnd.x - dragStart.x) >= 1 && glm::abs(dragEnd.y - dragStart.y) >= 1)
+	{
+		setRenderRegion({ (int) dragStart.x, (int) dragStart.y, (int) dragEnd.x, (int) dragEnd.y });
+	}
 }
 
 //--------------------------------------------------------------
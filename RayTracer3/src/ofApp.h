@@ -25,6 +25,15 @@
 
 #include "ofMain.h"
 #include "ofxGui.h"
+#include "bvh.h"
+#include "lighttree.h"
+#include "rng.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "texture.h"
+
+#include <atomic>
+#include <thread>
 
 #include <glm/gtx/intersect.hpp>
 #include <glm/gtx/vector_angle.hpp>
@@ -35,6 +44,7 @@
 class Ray
 {
 public:
+	Ray() {}
 	Ray(glm::vec3 p, glm::vec3 d)
 	{
 		this->p = p; this->d = d;
@@ -45,12 +55,25 @@ public:
 		ofDrawLine(p, p + t * d); 
 	}
 
-	glm::vec3 evalPoint(float t) 
+	glm::vec3 evalPoint(float t) const
 	{
 		return (p + t * d);
 	}
 
 	glm::vec3 p, d;
+
+	// Change of d from one pixel to the next in x and y, zero for rays that
+	// do not come from the camera
+	glm::vec3 dDdx = glm::vec3(0), dDdy = glm::vec3(0);
+};
+
+//  Closest hit along a ray, the point and normal are worked out from it
+//  only once the closest object is known
+//
+struct Hit
+{
+	float t = FLT_MAX;      // ray parameter, p + t * d is the hit point
+	int primitive = -1;     // which part of the object was hit, if it has parts
 };
 
 //  Base class for any renderable object in the scene
@@ -60,13 +83,69 @@ class SceneObject
 public: 
 	virtual void draw() = 0;    // pure virtual funcs - must be overloaded
 
-	virtual bool intersect(const Ray &ray, glm::vec3 &point, glm::vec3 &normal)
+	// Hit only counts if tmin < t < tmax, so a test can give up as soon as
+	// it knows the object is farther than the closest hit found so far
+	virtual bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit)
 	{
 		cout << "SceneObject::intersect" << endl;
 		return false;
 	}
 
-	void getTextureColor(const glm::vec3 &point, ofColor &baseColor, ofColor &specularColor);
+	// Closest hit test for the given lanes of a packet, lanes only count if
+	// 0 < t < hit.t.  Updates hit for the lanes that hit and returns them.
+	// By default each lane goes through intersect() on its own.
+	virtual simd::SimdMask intersectPacket(const simd::RayPacket &packet, simd::SimdMask lanes, simd::PacketHit &hit)
+	{
+		float t[PACKET_SIZE];
+		hit.t.store(t);
+		int bits = lanes.bits();
+		int hitBits = 0;
+		for (int lane = 0; lane < PACKET_SIZE; lane++)
+		{
+			Hit laneHit;
+			if (((bits >> lane) & 1) &&
+				intersect(Ray(packet.origin(lane), packet.direction(lane)), 0.0f, t[lane], laneHit))
+			{
+				t[lane] = laneHit.t;
+				hit.primitive[lane] = laneHit.primitive;
+				hitBits |= 1 << lane;
+			}
+		}
+		hit.t = simd::SimdFloat::load(t);
+		return simd::SimdMask::fromBits(hitBits);
+	}
+
+	// Only called for the closest hit
+	virtual glm::vec3 getNormal(const glm::vec3 &point, const Hit &hit)
+	{
+		return glm::vec3(0, 1, 0);
+	}
+
+	// Any hit test for shadow rays, true if the object blocks the ray before tmax
+	virtual bool occludes(const Ray &ray, float tmax)
+	{
+		Hit hit;
+		return intersect(ray, 0.0f, tmax, hit);
+	}
+
+	// World space box around the object.  Objects that return false cannot be
+	// bounded and are tested against every ray instead of going in the BVH
+	virtual bool getBounds(AABB &bounds)
+	{
+		return false;
+	}
+
+	// dPdx and dPdy span the pixel footprint around point, which picks the
+	// mip level.  Zero samples the full resolution texture.
+	void getTextureColor(const glm::vec3 &point, ofColor &baseColor, ofColor &specularColor,
+						 const glm::vec3 &dPdx = glm::vec3(0), const glm::vec3 &dPdy = glm::vec3(0));
+
+	// Textures are only sampled on the cpu and never go to GL, so scenes load
+	// without a GL context.  Objects using the same files share one copy.
+	void loadTextures(const std::string &texturePath, const std::string &specularPath)
+	{
+		texture = Texture::get(ofToDataPath(texturePath), ofToDataPath(specularPath));
+	}
 
 	virtual void evaluatePoint(const glm::vec3 &point, glm::vec2 &uv) {}
 
@@ -80,8 +159,7 @@ public:
 
 	// texture properties
 	bool isTextured = false;
-	ofImage texture;
-	ofImage specular;
+	std::shared_ptr<Texture> texture;       // diffuse and specular maps
 };
 
 //  General purpose sphere  (assume parametric)
@@ -104,8 +182,7 @@ public:
 		uMax = uMaxVal;
 		vMax = vMaxVal;
 		isTextured = true;
-		texture.load(texturePath);
-		specular.load(specularPath);
+		loadTextures(texturePath, specularPath);
 
 		// Random color so preview screen is clear
 		diffuseColor = ofColor(ofRandom(255.0f), ofRandom(255.0f), ofRandom(255.0f));
@@ -113,9 +190,72 @@ public:
 
 	Sphere() {}
 
-	bool intersect(const Ray &ray, glm::vec3 &point, glm::vec3 &normal)
+	bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit) override
+	{
+		countStat(STAT_SPHERE_TESTS);
+
+		// Solve |p + t * d - position|^2 = r^2, d does not need to be normalized
+		glm::vec3 oc = ray.p - position;
+		float a = glm::dot(ray.d, ray.d);
+		float halfB = glm::dot(oc, ray.d);
+		float c = glm::dot(oc, oc) - radius * radius;
+		float discriminant = halfB * halfB - a * c;
+		if (discriminant < 0)
+		{
+			return false;
+		}
+
+		// Nearer root first, the farther one only matters when starting inside
+		float root = sqrt(discriminant);
+		float t = (-halfB - root) / a;
+		if (t <= tmin || t >= tmax)
+		{
+			t = (-halfB + root) / a;
+			if (t <= tmin || t >= tmax)
+			{
+				return false;
+			}
+		}
+		hit.t = t;
+		return true;
+	}
+
+	// Same test as intersect() across the lanes of a packet
+	simd::SimdMask intersectPacket(const simd::RayPacket &packet, simd::SimdMask lanes, simd::PacketHit &hit) override
+	{
+		countStat(STAT_SPHERE_TESTS, lanes.count());
+		simd::SimdVec3 oc = packet.p - simd::SimdVec3(position);
+		simd::SimdFloat a = simd::dot(packet.d, packet.d);
+		simd::SimdFloat halfB = simd::dot(oc, packet.d);
+		simd::SimdFloat c = simd::dot(oc, oc) - simd::SimdFloat(radius * radius);
+		simd::SimdFloat discriminant = halfB * halfB - a * c;
+		simd::SimdFloat zero(0.0f);
+		lanes = lanes & (discriminant >= zero);
+		if (!lanes.any())
+		{
+			return lanes;
+		}
+
+		simd::SimdFloat root = simd::sqrt(simd::max(discriminant, zero));
+		simd::SimdFloat tNear = (zero - halfB - root) / a;
+		simd::SimdFloat tFar = (zero - halfB + root) / a;
+		simd::SimdMask nearValid = (tNear > zero) & (tNear < hit.t);
+		simd::SimdMask farValid = (tFar > zero) & (tFar < hit.t);
+		lanes = lanes & (nearValid | farValid);
+		hit.t = simd::select(lanes, simd::select(nearValid, tNear, tFar), hit.t);
+		hit.setPrimitive(lanes, -1);
+		return lanes;
+	}
+
+	glm::vec3 getNormal(const glm::vec3 &point, const Hit &hit) override
+	{
+		return (point - position) / radius;
+	}
+
+	bool getBounds(AABB &bounds) override
 	{
-		return (glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal));
+		bounds = AABB(position - glm::vec3(radius), position + glm::vec3(radius));
+		return true;
 	}
 
 	void draw()
@@ -147,15 +287,45 @@ public:
 	float vMax;
 };
 
-//  Mesh class (will complete later- this will be a refinement of Mesh from Project 1)
+//  Triangle mesh loaded from an OBJ file.  Vertices and triangle corners are
+//  kept in flat arrays and the triangles get a BVH of their own, so the whole
+//  mesh is a single box in the scene BVH however many triangles it has.
 //
 class Mesh : public SceneObject {
-	bool intersect(const Ray &ray, glm::vec3 &point, glm::vec3 &normal)
+public:
+	Mesh(const std::string &objPath, ofColor diffuse = ofColor::lightGray)
 	{
-		return false;
+		diffuseColor = diffuse;
+		load(objPath);
+	}
+
+	Mesh() {}
+
+	// Polygons are split into triangle fans.  False if the file has no faces.
+	bool load(const std::string &objPath);
+
+	bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit) override;
+	bool occludes(const Ray &ray, float tmax) override;
+	glm::vec3 getNormal(const glm::vec3 &point, const Hit &hit) override;
+	bool getBounds(AABB &bounds) override;
+	void draw();
+
+	int triangleCount() const
+	{
+		return indices.size() / 3;
 	}
 
-	void draw() {}
+	vector<glm::vec3> vertices;
+	vector<glm::vec3> normals;
+	vector<int> indices;            // three vertices per triangle
+	vector<int> normalIndices;      // three normals per triangle, or empty
+	BVH bvh;                        // over triangles, a packet of them per leaf
+
+	// Triangle corners in BVH leaf order, one array per corner and axis so a
+	// leaf's triangles load straight into SIMD lanes.  Padded with a packet
+	// of zeros so the last leaf can load past its end.
+	vector<float> leafCorners[3][3];
+	ofVboMesh preview;
 };
 
 
@@ -190,8 +360,7 @@ public:
 		uMax = uMaxVal;
 		vMax = vMaxVal;
 		isTextured = true;
-		texture.load(texturePath);
-		specular.load(specularPath);
+		loadTextures(texturePath, specularPath);
 		if (normal == glm::vec3(0, 1, 0))
 		{
 			plane.rotateDeg(-90, 1, 0, 0);
@@ -222,10 +391,12 @@ public:
 		// isSelectable = false;
 	}
 	
-	bool intersect(const Ray &ray, glm::vec3 & point, glm::vec3 & normal);
+	bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit) override;
+	simd::SimdMask intersectPacket(const simd::RayPacket &packet, simd::SimdMask lanes, simd::PacketHit &hit) override;
+	bool getBounds(AABB &bounds) override;
 	float sdf(const glm::vec3 & p);
 	
-	glm::vec3 getNormal(const glm::vec3 &p)
+	glm::vec3 getNormal(const glm::vec3 &p, const Hit &hit) override
 	{
 		return this->normal;
 	}
@@ -286,6 +457,37 @@ public:
 };
 
 
+//  Shared object placed in the scene with a transform and material of its
+//  own.  Rays are taken into the object's space instead of copying it, so
+//  any number of instances cost one copy of the geometry.  The scene BVH
+//  over instances and the BVH inside each mesh make a two level hierarchy.
+//
+class Instance : public SceneObject
+{
+public:
+	// The instance starts with the material and textures of the object
+	Instance(std::shared_ptr<SceneObject> object, const glm::mat4 &transform);
+
+	// Object space direction is not normalized, so t is the same in both
+	bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit) override;
+	bool occludes(const Ray &ray, float tmax) override;
+	glm::vec3 getNormal(const glm::vec3 &point, const Hit &hit) override;
+	bool getBounds(AABB &bounds) override;
+	void evaluatePoint(const glm::vec3 &point, glm::vec2 &uv) override;
+	void draw();
+
+	Ray toObject(const Ray &ray) const
+	{
+		return Ray(glm::vec3(inverse * glm::vec4(ray.p, 1.0f)), glm::vec3(inverse * glm::vec4(ray.d, 0.0f)));
+	}
+
+	std::shared_ptr<SceneObject> object;
+	glm::mat4 transform;
+	glm::mat4 inverse;
+	glm::mat3 normalMatrix;     // inverse transpose, takes normals to world space
+};
+
+
 // view plane for render camera
 // 
 class  ViewPlane: public Plane
@@ -302,7 +504,7 @@ public:
 		min = glm::vec2(-3, -2);
 		max = glm::vec2(3, 2);
 		position = glm::vec3(0, 0, 5);
-		normal = glm::vec3(0, 0, 1);      // viewplane currently limited to Z axis orientation
+		normal = glm::vec3(0, 0, 1);      // unused, RenderCam orients the plane along its aim
 	}
 
 	void setSize(glm::vec2 min, glm::vec2 max)
@@ -316,8 +518,6 @@ public:
 		return width() / height();
 	}
 
-	glm::vec3 toWorld(float u, float v);   //   (u, v) --> (x, y, z) [ world space ]
-
 	void draw()
 	{
 		ofDrawRectangle(glm::vec3(min.x, min.y, position.z), width(), height());
@@ -366,7 +566,9 @@ public:
 };
 
 
-//  render camera  - currently must be z axis aligned (we will improve this in project 4)
+//  render camera, looking along aim with the view plane at distance in
+//  front of it.  The view plane rectangle is given in the camera's right
+//  and up directions.
 //
 class RenderCam: public SceneObject
 {
@@ -375,9 +577,52 @@ public:
 	{
 		position = glm::vec3(0, 0, 10);
 		aim = glm::vec3(0, 0, -1);
+		up = glm::vec3(0, 1, 0);
+		updateBasis();
+	}
+
+	// Point the camera at target, up is kept as close to upVector as it can be
+	void lookAt(const glm::vec3 &target, const glm::vec3 &upVector = glm::vec3(0, 1, 0))
+	{
+		aim = glm::normalize(target - position);
+		up = upVector;
+		updateBasis();
+	}
+
+	// Vertical field of view in degrees, the view plane keeps its aspect ratio
+	void setFov(float degrees)
+	{
+		float halfHeight = distance * tan(glm::radians(degrees) / 2);
+		float halfWidth = halfHeight * view.getAspect();
+		view.setSize(glm::vec2(-halfWidth, -halfHeight), glm::vec2(halfWidth, halfHeight));
+		updateBasis();
 	}
 
-	Ray getRay(float u, float v);
+	float getFov()
+	{
+		return glm::degrees(2 * atan(view.height() / 2 / distance));
+	}
+
+	// Works out the frame used for ray generation, call after changing the
+	// camera directly
+	void updateBasis();
+
+	// Direction through view plane position (u, v), not normalized.  Linear
+	// in u and v, so a ray costs a few multiply adds.
+	glm::vec3 direction(float u, float v) const
+	{
+		return corner + u * across + v * upward;
+	}
+
+	// Fill in the differentials of a ray whose unnormalized direction had
+	// the given length
+	void setDifferentials(Ray &ray, float length, float du, float dv) const
+	{
+		glm::vec3 dx = du * across;
+		glm::vec3 dy = dv * upward;
+		ray.dDdx = (dx - ray.d * glm::dot(ray.d, dx)) / length;
+		ray.dDdy = (dy - ray.d * glm::dot(ray.d, dy)) / length;
+	}
 
 	void draw()
 	{
@@ -387,7 +632,32 @@ public:
 	void drawFrustum() {}
 
 	glm::vec3 aim;
+	glm::vec3 up;
+	float distance = 5;      // from the camera to the view plane
 	ViewPlane view;          // The camera viewplane, this is the view that we will render 
+
+	// Camera frame, and the view plane corner and edges relative to the camera
+	glm::vec3 right, trueUp;
+	glm::vec3 corner, across, upward;
+};
+
+
+// Sample positions of a light in structure of arrays form.  The arrays are
+// owned by the light and stay valid until its next updateSamples() call,
+// so reading them never allocates.
+//
+struct LightSamples
+{
+	const float* x = nullptr;
+	const float* y = nullptr;
+	const float* z = nullptr;
+	int count = 0;
+
+	// Indices of a few samples spread across the light, shadow tested first
+	// to tell fully lit and fully shadowed points from penumbrae.  Empty
+	// when the light has too few samples for it to pay.
+	const int* probes = nullptr;
+	int probeCount = 0;
 };
 
 
@@ -402,9 +672,24 @@ public:
 		this->intensity = intensityValue;
 	}
 
-	virtual int getRaySamples(const glm::vec3 p, vector<Ray> &samples)
+	LightSamples getSamples() const
 	{
-		return 0;
+		LightSamples samples;
+		samples.x = sampleX.data();
+		samples.y = sampleY.data();
+		samples.z = sampleZ.data();
+		samples.count = sampleX.size();
+		samples.probes = probes.data();
+		samples.probeCount = probes.size();
+		return samples;
+	}
+
+	// Called once before a render starts, so getSamples is read only
+	// and can be shared between render threads.  Returns true if the
+	// samples moved since the last call.
+	virtual bool updateSamples()
+	{
+		return false;
 	}
 
 	virtual void draw() {}
@@ -417,7 +702,7 @@ public:
 		gui.add(intensity.set("Intensity", this->intensity, 0.0f, 1000.0f));
 	}
 
-	bool intersect(const Ray &ray, glm::vec3 &point, glm::vec3 &normal)
+	bool intersect(const Ray &ray, float tmin, float tmax, Hit &hit) override
 	{
 		return false;
 	}
@@ -428,6 +713,34 @@ public:
 	ofxPanel gui;
 	ofParameter<glm::vec3> position;
 	ofParameter<float> intensity;
+
+	// Intensity the render threads read, copied from the gui parameter
+	// before a render starts
+	float renderIntensity = 0;
+
+	// Key of this light's random numbers, set to the light's index when it
+	// is added to the scene so the samples depend on the scene alone and two
+	// lights never share a pattern
+	uint32_t sampleSeed = 0;
+
+protected:
+	void setSampleCount(int count)
+	{
+		// Only reallocates when the count grows
+		sampleX.resize(count);
+		sampleY.resize(count);
+		sampleZ.resize(count);
+	}
+
+	void setSample(int index, const glm::vec3 &samplePosition)
+	{
+		sampleX[index] = samplePosition.x;
+		sampleY[index] = samplePosition.y;
+		sampleZ[index] = samplePosition.z;
+	}
+
+	vector<float> sampleX, sampleY, sampleZ;
+	vector<int> probes;
 };
 
 
@@ -438,15 +751,17 @@ class PointLight : public Light
 public:
 	PointLight(glm::vec3 p, float intensityValue) : Light(p, intensityValue) {}
 
-	int getRaySamples(const glm::vec3 p, vector<Ray> &samples) override
+	bool updateSamples() override
 	{
-		// Ray should start at the light and point towards point
-		glm::vec3 direction = -(this->position - p);
-		Ray lightRay(this->position, direction);
-		samples.push_back(lightRay);
-
-		// Return n, number of lights
-		return 1;
+		// Single sample at the light position
+		glm::vec3 currentPosition = position;
+		if (sampleX.size() == 1 && currentPosition == glm::vec3(sampleX[0], sampleY[0], sampleZ[0]))
+		{
+			return false;
+		}
+		setSampleCount(1);
+		setSample(0, currentPosition);
+		return true;
 	}
 
 	void draw()
@@ -476,7 +791,7 @@ public:
 		lightPlane.rotateDeg(90, 1, 0, 0);
 	}
 
-	int getRaySamples(const glm::vec3 p, vector<Ray> &samples) override
+	bool updateSamples() override
 	{
 		// Get current position value for comparison
 		glm::vec3 currentPosition = position;
@@ -493,18 +808,9 @@ public:
 			this->prevNDivsHeight = this->nDivsHeight;
 			this->prevNSamples = this->nSamples;
 			this->prevPosition = this->position;
+			return true;
 		}
-		
-		for (glm::vec3 lightPosition : precomputedSamples)
-		{
-			// Compute rays from positions
-			glm::vec3 direction = -(lightPosition - p);
-			Ray lightRay(lightPosition, direction);
-
-			samples.push_back(lightRay);
-		}
-
-		return samples.size();
+		return false;
 	}
 
 	void draw()
@@ -541,30 +847,51 @@ private:
 	int prevNDivsWidth = -1, prevNDivsHeight = -1;
 	int prevNSamples = -1;
 
-	vector<glm::vec3> precomputedSamples;
-
 	void computeRaySamples()
 	{
-		precomputedSamples.clear();
+		setSampleCount(nDivsWidth * nDivsHeight * nSamples);
+		int sampleIndex = 0;
+
 		// Precompute cell level values
 		float cellWidth = this->width / nDivsWidth;
 		float cellHeight = this->height / nDivsHeight;
 
+		// Probe the corner cells, one sample each.  With no more samples
+		// than that there is nothing to save.
+		probes.clear();
+		if (nDivsWidth * nDivsHeight * nSamples > 4)
+		{
+			int lastWidth = nDivsWidth - 1;
+			int lastHeight = nDivsHeight - 1;
+			int cells[4][2] = { { 0, 0 }, { lastWidth, 0 }, { 0, lastHeight }, { lastWidth, lastHeight } };
+			for (int c = 0; c < 4; c++)
+			{
+				int index = (cells[c][0] * nDivsHeight + cells[c][1]) * nSamples;
+				if (std::find(probes.begin(), probes.end(), index) == probes.end())
+				{
+					probes.push_back(index);
+				}
+			}
+		}
+
 		// Iterate over every cell
 		for (int widthCounter = 0; widthCounter < this->nDivsWidth; widthCounter++)
 		{
 			for (int heightCounter = 0; heightCounter < this->nDivsHeight; heightCounter++)
 			{
+				int cell = widthCounter * this->nDivsHeight + heightCounter;
 				for (int sample = 0; sample < this->nSamples; sample++)
 				{
-					// Compute sample light position
-					glm::vec3 basePosition(ofRandom(cellWidth) + widthCounter * cellWidth, 0.0f,
-										   ofRandom(cellHeight) + heightCounter * cellHeight);
+					// Compute sample light position, jittered within the cell
+					float jitterX = sampleFloat(sampleSeed, cell, sample, RNG_LIGHT_X);
+					float jitterZ = sampleFloat(sampleSeed, cell, sample, RNG_LIGHT_Z);
+					glm::vec3 basePosition((jitterX + widthCounter) * cellWidth, 0.0f,
+										   (jitterZ + heightCounter) * cellHeight);
 					
 					// Add base position (0, 0, 0) to grid position
 					glm::vec3 lightPosition = this->position + basePosition;
 
-					precomputedSamples.push_back(lightPosition);
+					setSample(sampleIndex++, lightPosition);
 				}
 			}
 		}
@@ -572,12 +899,108 @@ private:
 };
 
 
+// Per render thread state, one for each worker of the tile scheduler
+//
+struct TraceContext
+{
+	// Object that last blocked a shadow ray towards each light, tried first
+	// since neighbouring shading points tend to be blocked by the same object
+	vector<SceneObject*> lastOccluder;
+
+	// counters and timers of the work done on this thread
+	RenderStats stats;
+
+	// visibility bits of one light's samples while shading, when they are
+	// not going into the G-buffer
+	vector<uint64_t> visibleScratch;
+};
+
+
+// Lights with more samples than this are not kept in the visibility cache
+#define MAX_CACHED_LIGHT_SAMPLES 256
+
+// Scenes with at least this many lit lights shade a few lights picked from
+// the light tree instead of every one
+#define LIGHT_TREE_MIN_LIGHTS 16
+#define LIGHT_TREE_PICKS 4
+
+// Largest contribution, in 8 bit output levels, a light can have at a point
+// and still be culled there.  Below the light tree's light count, the lights
+// culled at a point leave out less than one level between them.
+#define LIGHT_CULL_LEVEL (1.0f / LIGHT_TREE_MIN_LIGHTS)
+
+// First hit of the center sample of a pixel, kept so lighting changes can
+// be re-shaded without tracing primary rays again
+//
+struct GBufferSample
+{
+	SceneObject* object = nullptr;
+	glm::vec3 point;
+	glm::vec3 normal;
+	ofColor baseColor;
+	ofColor specularColor;
+};
+
+
+// Gui parameters a render reads, copied before its threads start so edits
+// made while it runs do not race with them
+//
+struct RenderSettings
+{
+	float phongPower = 10.0f;
+	float lambertCoefficient = 1.0f;
+	int samplesPerPixel = 1;
+	float aaThreshold = 2.0f;
+	bool adaptiveShadows = true;
+	bool heatmapByTime = false;
+};
+
+
+// One sweep over the image.  Passes with blockSize > 1 trace one pixel per
+// block and fill the block with it as a preview, sample > 0 adds a jittered
+// sample to every pixel.  An adaptive pass adds a few more samples to just
+// the pixels that still need them.
+//
+struct RenderPass
+{
+	int blockSize;
+	int sample;
+	bool firstPass;
+	bool adaptive;
+};
+
+
+// Pixel sample waiting in a tile for its packet of primary rays, sample is
+// its index among the samples of the pixel
+//
+struct PixelSample
+{
+	int i, j;
+	float du, dv;
+	int sample;
+};
+
+
+// Set in a published pixel once it has a sample
+#define PIXEL_RESOLVED 0xFF000000u
+
+// Every pixel gets this many samples before any adaptive ones, and each
+// adaptive pass adds up to this many more to the pixels that need them
+#define AA_BASE_SAMPLES 4
+#define AA_ROUND_SAMPLES 4
+
+// Difference in mean luminance, in 8 bit levels, that makes neighbouring
+// pixels count as an edge
+#define AA_EDGE_CONTRAST 32
+
+
 class ofApp : public ofBaseApp
 {
 	public:
 		void setup();
 		void update();
 		void draw();
+		void exit();
 
 		void keyPressed(int key);
 		void keyReleased(int key);
@@ -592,16 +1015,65 @@ class ofApp : public ofBaseApp
 		void gotMessage(ofMessage msg);
 
 		// Part 1: Raytracing
-		void rayTrace();
+		void setupScene();
+		void addLight(Light* light);
+		void rayTrace(const std::string &fileName = "image.jpg");
+		void startRender(bool reshade = false);
+		void stopRender();
+		bool prepareRender(bool progressive, bool reshade);
+		void renderPasses(bool progressive, bool reshade);
+		void renderTile(const Tile &tile, const RenderPass &pass, TraceContext &context);
+		void reshadeTile(const Tile &tile, TraceContext &context);
+		void tracePacket(const PixelSample* samples, int count, const RenderPass &pass, TraceContext &context);
+		void storeSample(const PixelSample &pixel, const ofColor &color, SceneObject* object, const RenderPass &pass);
+		void publishPixel(int index);
+		void markObjectEdges();
+		bool needsSamples(int index);
+		ofColor shadeHit(const Ray &ray, SceneObject* object, const Hit &hit, TraceContext &context,
+						 int gbufferIndex = -1);
+		void updateImage();
+		void collectStats(double wallSeconds);
+		void saveImage(const std::string &fileName);
+		float saveHeatmap(const std::string &fileName);
+		double costMeter(const TraceContext &context);
+		void setRenderRegion(const Tile &region);
+		Tile imageRegion();
+		void renderSettingChanged(ofAbstractParameter &parameter);
 		void drawGrid();
 		void drawAxis(glm::vec3 position);
 
 		// Part 2: Shading
-		ofColor lambert(const glm::vec3 &p, const glm::vec3 &norm, const ofColor diffuse);
 		ofColor phong(const glm::vec3 &p, const glm::vec3 &norm, const ofColor diffuse,
-				      const ofColor specular, float power);
-
-		bool isShadow(const glm::vec3 &p, const Ray &lightRay);
+				      const ofColor specular, float power, TraceContext &context,
+				      int gbufferIndex = -1);
+		ofColor phongCached(int gbufferIndex, float power);
+		void shadeLight(ofColor &resultColor, int lightIndex, float weight, const glm::vec3 &p,
+						const glm::vec3 &normal, const glm::vec3 &viewerDirection, const ofColor &diffuse,
+						const ofColor &specular, float power, TraceContext &context, uint64_t* visibleBits);
+		float shadingPeak(const ofColor &diffuse, const ofColor &specular);
+		bool isLightCulled(int lightIndex, const glm::vec3 &p, float peak);
+		void addLightSample(ofColor &resultColor, const glm::vec3 &p, const glm::vec3 &normal,
+						    const glm::vec3 &viewerDirection, const glm::vec3 &lightPosition,
+						    float intensity, const ofColor &diffuse, const ofColor &specular, float power);
+
+		bool isShadow(const glm::vec3 &p, const glm::vec3 &lightPosition, SceneObject* &lastOccluder);
+		void lightVisibility(const glm::vec3 &p, int lightIndex, TraceContext &context, uint64_t* visibleBits);
+
+		// Acceleration structure over the scene, rebuilt at the start of each render
+		void buildBVH();
+		SceneObject* closestHit(const Ray &ray, Hit &hit);
+		void closestHitPacket(const simd::RayPacket &packet, simd::PacketHit &hit, SceneObject* objects[PACKET_SIZE]);
+
+		// Bounds of each light's samples, for culling lights too far away to
+		// show and for the light tree
+		vector<AABB> lightBounds;
+		LightTree lightTree;
+		bool bUseLightTree = false;
+
+		vector<TraceContext> traceContexts;     // one per render thread
+		BVH sceneBVH;
+		vector<SceneObject*> bvhObjects;        // indexed by BVH primitive index
+		vector<SceneObject*> unboundedObjects;  // tested linearly against every ray
 
 		bool bHide = true;
 		bool bShowImage = false;
@@ -616,6 +1088,9 @@ class ofApp : public ofBaseApp
 		RenderCam renderCam;
 		ofImage image;
 
+		// Scene file loaded by setupScene, the built in scene if empty
+		std::string sceneFile;
+
 		// scene holds everything including lights, but lights holds only lights
 		vector<SceneObject*> scene;
 		vector<Light*> lights;
@@ -623,6 +1098,67 @@ class ofApp : public ofBaseApp
 		int imageWidth = 1800;
 		int imageHeight = 1200;
 
+		// Part of the image to trace, in image pixels with rows running top
+		// to bottom.  Empty for the whole image.  Pixels outside it keep what
+		// the image already held.
+		Tile renderRegion = { 0, 0, 0, 0 };
+
+		// Tiles [firstTile, lastTile) of the region only, so scripts can split
+		// a frame over several renders.  lastTile < 0 runs to the end.
+		int firstTile = 0;
+		int lastTile = -1;
+
+		// Region being shift dragged out over the displayed image
+		bool bSelectingRegion = false;
+		glm::vec2 dragStart;
+		glm::vec2 dragEnd;
+
+		// render threads, defaults to one per core
+		int numThreads = TileScheduler::defaultThreadCount();
+
+		// background render job, sums of samples per pixel in image row order
+		std::thread renderThread;
+		std::atomic<bool> bRendering { false };
+		std::atomic<bool> bRenderFinished { false };
+		std::atomic<bool> bCancelRender { false };
+		bool bRestartRender = false;
+		bool bLightingOnly = true;
+		vector<glm::vec3> accumulation;
+		vector<int> sampleCounts;
+
+		// Mean color of each pixel packed as PIXEL_RESOLVED | rgb, the only
+		// per pixel state the preview reads while the render runs
+		vector<std::atomic<uint32_t>> resolved;
+
+		// Per pixel luminance sums and the object hit by its center sample,
+		// for deciding where adaptive passes add samples.  pixelEdge is set
+		// once the pixel's samples hit more than one object, or it differs
+		// from a neighbour in object or brightness.
+		vector<float> lumaSum;
+		vector<float> lumaSquares;
+		vector<SceneObject*> pixelObject;
+		vector<uint8_t> pixelEdge;
+
+		// re-shading cache, first hits plus one visibility bit per light sample
+		// for every pixel.  Lights whose samples moved are marked dirty and only
+		// their shadow rays are traced again.
+		vector<GBufferSample> gbuffer;
+		vector<vector<uint64_t>> visibility;    // per light
+		vector<int> visibilityWords;            // 64 bit words per pixel, per light
+		vector<bool> lightDirty;
+
+		// Light intensity and lambert coefficient each light's visibility was
+		// culled with, raising either past these means tracing it again
+		vector<float> cullIntensity;
+		vector<float> cullLambert;
+		bool bRecordGBuffer = false;
+		std::atomic<bool> bGBufferValid { false };
+
+		// A re-shade only has the G-buffer's center sample, so with more
+		// samples per pixel the image stays refining until a render traces
+		// the rest
+		bool bRefining = false;
+
 		ofColor backgroundColor = ofColor::black;
 
 		bool bDrawImage = false;
@@ -632,8 +1168,39 @@ class ofApp : public ofBaseApp
 		// amount of color determined by lambert shading
 		ofParameter<float> lambertCoefficient = 1.0f;
 
+		// most samples a pixel gets, adaptive passes stop adding them once the
+		// standard error of its luminance is below aaThreshold (in 8 bit levels)
+		// and it is not on an object edge
+		ofParameter<int> samplesPerPixel = 1;
+		ofParameter<float> aaThreshold = 2.0f;
+
+		// Cost of every pixel of the render, saved as a false color image next
+		// to it.  Cost is intersection tests, or microseconds if heatmapByTime.
+		ofParameter<bool> costHeatmap = false;
+		ofParameter<bool> heatmapByTime = false;
+		vector<float> pixelCost;
+
+		// shadow test an area light's four corner probes first and trust them
+		// when they agree.  Outside penumbrae that cuts a light's shadow rays
+		// by its sample count over four, about 6x for a 5x5 light and only
+		// an order of magnitude from around 40 samples.
+		ofParameter<bool> adaptiveShadows = true;
+
+		// what the render in progress, or the last one, was started with
+		RenderSettings settings;
+
+		// totals of the last finished render, shown in the stats panel
+		RenderStats renderStats;
+		std::chrono::steady_clock::time_point renderStart;
+
 		// gui
 		bool hideGui = false;
 		ofxPanel gui;
+		ofxPanel statsGui;
+		ofxLabel raysPerSecondLabel;
+		ofxLabel refiningLabel;
+		ofxLabel heatmapScaleLabel;
+		ofxLabel counterLabels[STAT_COUNTERS];
+		ofxLabel timerLabels[STAT_TIMERS];
 };
  
\ No newline at end of file
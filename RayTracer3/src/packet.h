@@ -0,0 +1,258 @@
+//
+//  packet.h
+//
+//  Small SIMD layer for tracing several coherent primary rays at once, one
+//  ray per lane.  8 lanes with AVX, 4 with SSE, and a plain 4 float array
+//  when neither is available so the same tracing code builds everywhere.
+//  Everything is in namespace simd so its min, max, sqrt and friends stay
+//  out of the overload sets of plain float code.
+//
+
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define PACKET_AVX
+#define PACKET_SIZE 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PACKET_SSE
+#define PACKET_SIZE 4
+#else
+#define PACKET_SIZE 4
+#endif
+
+
+namespace simd
+{
+
+// One bit per lane, set lanes are the ones an operation applies to
+//
+struct SimdMask
+{
+#if defined(PACKET_AVX)
+	__m256 v;
+	int bits() const { return _mm256_movemask_ps(v); }
+#elif defined(PACKET_SSE)
+	__m128 v;
+	int bits() const { return _mm_movemask_ps(v); }
+#else
+	int v;
+	int bits() const { return v; }
+#endif
+
+	bool any() const { return bits() != 0; }
+	bool lane(int i) const { return (bits() >> i) & 1; }
+
+	// Number of lanes set
+	int count() const
+	{
+		int n = 0;
+		for (int b = bits(); b != 0; b &= b - 1)
+		{
+			n++;
+		}
+		return n;
+	}
+
+	// First count lanes set
+	static SimdMask firstLanes(int count);
+
+	// Lane i set if bit i is
+	static SimdMask fromBits(int bits);
+};
+
+
+struct SimdFloat
+{
+#if defined(PACKET_AVX)
+	__m256 v;
+	SimdFloat() {}
+	SimdFloat(__m256 x) : v(x) {}
+	explicit SimdFloat(float x) : v(_mm256_set1_ps(x)) {}
+	static SimdFloat load(const float *p) { return _mm256_loadu_ps(p); }
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+#elif defined(PACKET_SSE)
+	__m128 v;
+	SimdFloat() {}
+	SimdFloat(__m128 x) : v(x) {}
+	explicit SimdFloat(float x) : v(_mm_set1_ps(x)) {}
+	static SimdFloat load(const float *p) { return _mm_loadu_ps(p); }
+	void store(float *p) const { _mm_storeu_ps(p, v); }
+#else
+	float v[PACKET_SIZE];
+	SimdFloat() {}
+	explicit SimdFloat(float x) { for (int i = 0; i < PACKET_SIZE; i++) v[i] = x; }
+	static SimdFloat load(const float *p) { SimdFloat r; for (int i = 0; i < PACKET_SIZE; i++) r.v[i] = p[i]; return r; }
+	void store(float *p) const { for (int i = 0; i < PACKET_SIZE; i++) p[i] = v[i]; }
+#endif
+
+	float operator[](int i) const
+	{
+		float lanes[PACKET_SIZE];
+		store(lanes);
+		return lanes[i];
+	}
+};
+
+
+#if defined(PACKET_AVX)
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat sqrt(SimdFloat a) { return _mm256_sqrt_ps(a.v); }
+inline SimdFloat rsqrtEstimate(SimdFloat a) { return _mm256_rsqrt_ps(a.v); }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline SimdMask operator&(SimdMask a, SimdMask b) { return { _mm256_and_ps(a.v, b.v) }; }
+inline SimdMask operator|(SimdMask a, SimdMask b) { return { _mm256_or_ps(a.v, b.v) }; }
+inline SimdMask andNot(SimdMask a, SimdMask b) { return { _mm256_andnot_ps(b.v, a.v) }; }    // a & ~b
+inline SimdFloat select(SimdMask m, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+inline SimdMask SimdMask::firstLanes(int count)
+{
+	__m256 lanes = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	return { _mm256_cmp_ps(lanes, _mm256_set1_ps((float) count), _CMP_LT_OQ) };
+}
+inline SimdMask SimdMask::fromBits(int bits)
+{
+	int32_t lanes[8];
+	for (int i = 0; i < 8; i++) lanes[i] = ((bits >> i) & 1) ? -1 : 0;
+	return { _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*) lanes)) };
+}
+
+#elif defined(PACKET_SSE)
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+inline SimdFloat sqrt(SimdFloat a) { return _mm_sqrt_ps(a.v); }
+inline SimdFloat rsqrtEstimate(SimdFloat a) { return _mm_rsqrt_ps(a.v); }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+inline SimdMask operator&(SimdMask a, SimdMask b) { return { _mm_and_ps(a.v, b.v) }; }
+inline SimdMask operator|(SimdMask a, SimdMask b) { return { _mm_or_ps(a.v, b.v) }; }
+inline SimdMask andNot(SimdMask a, SimdMask b) { return { _mm_andnot_ps(b.v, a.v) }; }    // a & ~b
+inline SimdFloat select(SimdMask m, SimdFloat a, SimdFloat b)
+{
+	// No blendv before SSE4.1
+	return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+}
+inline SimdMask SimdMask::firstLanes(int count)
+{
+	__m128 lanes = _mm_set_ps(3, 2, 1, 0);
+	return { _mm_cmplt_ps(lanes, _mm_set1_ps((float) count)) };
+}
+inline SimdMask SimdMask::fromBits(int bits)
+{
+	int32_t lanes[4];
+	for (int i = 0; i < 4; i++) lanes[i] = ((bits >> i) & 1) ? -1 : 0;
+	return { _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) lanes)) };
+}
+
+#else
+
+#define PACKET_LANEWISE(expr) SimdFloat r; for (int i = 0; i < PACKET_SIZE; i++) r.v[i] = (expr); return r;
+#define PACKET_COMPARE(op) SimdMask m = { 0 }; for (int i = 0; i < PACKET_SIZE; i++) m.v |= (a.v[i] op b.v[i]) << i; return m;
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] + b.v[i]) }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] - b.v[i]) }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] * b.v[i]) }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] / b.v[i]) }
+inline SimdFloat sqrt(SimdFloat a) { PACKET_LANEWISE(std::sqrt(a.v[i])) }
+inline SimdFloat rsqrtEstimate(SimdFloat a) { PACKET_LANEWISE(1.0f / std::sqrt(a.v[i])) }
+inline SimdFloat min(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat max(SimdFloat a, SimdFloat b) { PACKET_LANEWISE(a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { PACKET_COMPARE(<) }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { PACKET_COMPARE(>) }
+inline SimdMask operator<=(SimdFloat a, SimdFloat b) { PACKET_COMPARE(<=) }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { PACKET_COMPARE(>=) }
+inline SimdMask operator&(SimdMask a, SimdMask b) { return { a.v & b.v }; }
+inline SimdMask operator|(SimdMask a, SimdMask b) { return { a.v | b.v }; }
+inline SimdMask andNot(SimdMask a, SimdMask b) { return { a.v & ~b.v }; }
+inline SimdFloat select(SimdMask m, SimdFloat a, SimdFloat b) { PACKET_LANEWISE(((m.v >> i) & 1) ? a.v[i] : b.v[i]) }
+inline SimdMask SimdMask::firstLanes(int count) { return { (1 << count) - 1 }; }
+inline SimdMask SimdMask::fromBits(int bits) { return { bits }; }
+
+#undef PACKET_LANEWISE
+#undef PACKET_COMPARE
+
+#endif
+
+inline SimdFloat abs(SimdFloat a)
+{
+	return max(a, SimdFloat(0.0f) - a);
+}
+
+// 1 / sqrt(a), the hardware estimate refined by one Newton step to near
+// full float precision
+inline SimdFloat rsqrt(SimdFloat a)
+{
+	SimdFloat r = rsqrtEstimate(a);
+	return r * (SimdFloat(1.5f) - SimdFloat(0.5f) * a * r * r);
+}
+
+
+struct SimdVec3
+{
+	SimdFloat x, y, z;
+
+	SimdVec3() {}
+	SimdVec3(SimdFloat x, SimdFloat y, SimdFloat z) : x(x), y(y), z(z) {}
+	explicit SimdVec3(const glm::vec3 &p) : x(p.x), y(p.y), z(p.z) {}
+
+	SimdFloat &operator[](int axis) { return axis == 0 ? x : (axis == 1 ? y : z); }
+	const SimdFloat &operator[](int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+};
+
+inline SimdVec3 operator-(const SimdVec3 &a, const SimdVec3 &b) { return SimdVec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline SimdFloat dot(const SimdVec3 &a, const SimdVec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+
+// Rays of a packet, lanes past the ones in use hold copies of lane 0
+//
+struct RayPacket
+{
+	SimdVec3 p, d;
+	SimdVec3 invD;
+	SimdMask active;
+
+	glm::vec3 origin(int lane) const { return glm::vec3(p.x[lane], p.y[lane], p.z[lane]); }
+	glm::vec3 direction(int lane) const { return glm::vec3(d.x[lane], d.y[lane], d.z[lane]); }
+};
+
+
+// Closest hits of a packet so far, t is FLT_MAX in lanes that hit nothing
+//
+struct PacketHit
+{
+	SimdFloat t;
+	int primitive[PACKET_SIZE];
+
+	void setPrimitive(SimdMask lanes, int value)
+	{
+		int bits = lanes.bits();
+		for (int lane = 0; lane < PACKET_SIZE; lane++)
+		{
+			if ((bits >> lane) & 1)
+			{
+				primitive[lane] = value;
+			}
+		}
+	}
+};
+
+}
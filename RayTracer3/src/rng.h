@@ -0,0 +1,57 @@
+//
+//  rng.h
+//
+//  Stateless random numbers for sampling.  Each number is a hash of the
+//  keys that name it (pixel, sample index, dimension and so on), so there is
+//  no generator state to share between threads and the same sample gets the
+//  same number whatever order the tiles are rendered in.
+//
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+
+// Dimensions of a sample, so the numbers drawn for one use never line up
+// with the numbers of another
+//
+#define RNG_PIXEL_JITTER_X 0
+#define RNG_PIXEL_JITTER_Y 1
+#define RNG_LIGHT_X 2
+#define RNG_LIGHT_Z 3
+#define RNG_LIGHT_PICK 4
+
+
+// PCG hash (Jarzynski and Olano, "Hash Functions for GPU Rendering"), one
+// round of the PCG generator applied to the input
+//
+inline uint32_t pcgHash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Hash of several keys, each one fed through the hash along with the
+// result so far
+//
+inline uint32_t sampleHash(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	return pcgHash(a ^ pcgHash(b ^ pcgHash(c ^ pcgHash(d))));
+}
+
+// Uniform float in [0, 1) from the top 24 bits of the hash
+//
+inline float sampleFloat(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	return (sampleHash(a, b, c, d) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Bits of a float, for keying numbers on a position
+//
+inline uint32_t floatBits(float f)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
@@ -0,0 +1,484 @@
+//
+//  scene.cpp
+//
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include "ofApp.h"
+#include "scene.h"
+
+#define SCENE_MAGIC "RTSCN02"
+#define SCENE_SECTIONS 8
+
+
+// Binary scene layout: the header, then each section's records at its
+// offset, in the byte order of the machine that wrote the file
+//
+struct SceneSection
+{
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct SceneFileHeader
+{
+	char magic[8];
+	SceneSection sections[SCENE_SECTIONS];   // camera, materials, spheres, planes, meshes, instances, lights, strings
+};
+
+
+static uint64_t alignSection(uint64_t offset)
+{
+	return (offset + 7) / 8 * 8;
+}
+
+template<class T>
+static bool mapSection(const MappedFile &file, const SceneSection &section, SceneRecords<T> &records)
+{
+	if (section.offset % alignof(T) != 0 || section.offset > file.size() ||
+		section.count > (file.size() - section.offset) / sizeof(T))
+	{
+		return false;
+	}
+	records.data = (const T*) (file.data() + section.offset);
+	records.count = section.count;
+	return true;
+}
+
+template<class T>
+static void writeSection(std::ofstream &out, const SceneRecords<T> &records)
+{
+	static const char padding[8] = { 0 };
+	out.write(padding, alignSection(out.tellp()) - (uint64_t) out.tellp());
+	out.write((const char*) records.data, records.count * sizeof(T));
+}
+
+template<class T>
+static SceneRecords<T> recordsOf(const std::vector<T> &store)
+{
+	SceneRecords<T> records;
+	records.data = store.data();
+	records.count = store.size();
+	return records;
+}
+
+
+bool SceneFile::load(const std::string &path)
+{
+	const std::string binaryExtension = ".sceneb";
+	bool binary = path.size() >= binaryExtension.size() &&
+		path.compare(path.size() - binaryExtension.size(), binaryExtension.size(), binaryExtension) == 0;
+	return binary ? mapBinary(ofToDataPath(path)) : parseText(path);
+}
+
+bool SceneFile::parseText(const std::string &path)
+{
+	ofBuffer buffer = ofBufferFromFile(path);
+	if (buffer.size() == 0)
+	{
+		cout << "Scene: could not read " << path << endl;
+		return false;
+	}
+
+	std::map<std::string, int> materialNames;
+	std::map<std::string, int> meshNames;
+	auto addString = [&](const std::string &s)
+	{
+		int32_t offset = stringStore.size();
+		stringStore.insert(stringStore.end(), s.begin(), s.end());
+		stringStore.push_back('\0');
+		return offset;
+	};
+
+	// Camera lines fill in one record, starting from the RenderCam defaults
+	auto cameraRecord = [&]() -> SceneCamera&
+	{
+		if (cameraStore.empty())
+		{
+			cameraStore.push_back({ { 0, 0, 10 }, { 0, 0, -1 }, { 0, 1, 0 }, { -3, -2 }, { 3, 2 }, 5, 0, { 0, 0, 0 } });
+		}
+		return cameraStore[0];
+	};
+
+	std::istringstream text(buffer.getText());
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(text, line))
+	{
+		lineNumber++;
+		std::istringstream in(line);
+		std::string keyword;
+		if (!(in >> keyword) || keyword[0] == '#')
+		{
+			continue;
+		}
+
+		// Material and mesh references by name, "-" for the default material
+		std::string error;
+		auto lookup = [&](std::map<std::string, int> &names, const char* kind, bool allowDefault)
+		{
+			std::string name;
+			in >> name;
+			if (allowDefault && name == "-")
+			{
+				return -1;
+			}
+			auto found = names.find(name);
+			if (found == names.end())
+			{
+				error = std::string("unknown ") + kind + " " + name;
+				return -1;
+			}
+			return found->second;
+		};
+
+		if (keyword == "camera")
+		{
+			float* p = cameraRecord().position;
+			in >> p[0] >> p[1] >> p[2];
+		}
+		else if (keyword == "lookat")
+		{
+			SceneCamera &camera = cameraRecord();
+			float target[3];
+			in >> target[0] >> target[1] >> target[2];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				camera.aim[axis] = target[axis] - camera.position[axis];
+			}
+		}
+		else if (keyword == "aim")
+		{
+			float* a = cameraRecord().aim;
+			in >> a[0] >> a[1] >> a[2];
+		}
+		else if (keyword == "up")
+		{
+			float* u = cameraRecord().up;
+			in >> u[0] >> u[1] >> u[2];
+		}
+		else if (keyword == "view")
+		{
+			SceneCamera &camera = cameraRecord();
+			in >> camera.viewMin[0] >> camera.viewMin[1] >> camera.viewMax[0] >> camera.viewMax[1] >> camera.distance;
+		}
+		else if (keyword == "fov")
+		{
+			in >> cameraRecord().fov;
+		}
+		else if (keyword == "background")
+		{
+			float* c = cameraRecord().background;
+			in >> c[0] >> c[1] >> c[2];
+		}
+		else if (keyword == "material")
+		{
+			std::string name;
+			SceneMaterial material = { { 0 }, { 0 }, -1, -1, 1, 1 };
+			in >> name;
+			in >> material.diffuse[0] >> material.diffuse[1] >> material.diffuse[2];
+			in >> material.specular[0] >> material.specular[1] >> material.specular[2];
+			// Texture maps are optional, running out of line after the colors is fine
+			std::string option;
+			if (!in.fail() && !(in >> option))
+			{
+				in.clear();
+			}
+			else if (!option.empty())
+			{
+				std::string texturePath, specularPath;
+				in >> texturePath >> specularPath >> material.uMax >> material.vMax;
+				if (option != "texture")
+				{
+					error = "expected texture after the colors";
+				}
+				material.texture = addString(texturePath);
+				material.specularTexture = addString(specularPath);
+			}
+			materialNames[name] = materialStore.size();
+			materialStore.push_back(material);
+		}
+		else if (keyword == "sphere")
+		{
+			SceneSphere sphere;
+			in >> sphere.position[0] >> sphere.position[1] >> sphere.position[2] >> sphere.radius;
+			sphere.material = lookup(materialNames, "material", true);
+			sphereStore.push_back(sphere);
+		}
+		else if (keyword == "plane")
+		{
+			ScenePlane plane;
+			in >> plane.position[0] >> plane.position[1] >> plane.position[2];
+			in >> plane.normal[0] >> plane.normal[1] >> plane.normal[2];
+			in >> plane.width >> plane.height;
+			plane.material = lookup(materialNames, "material", true);
+			planeStore.push_back(plane);
+		}
+		else if (keyword == "mesh")
+		{
+			std::string name, meshPath;
+			in >> name >> meshPath;
+			meshNames[name] = meshStore.size();
+			meshStore.push_back({ addString(meshPath) });
+		}
+		else if (keyword == "instance")
+		{
+			SceneInstance instance;
+			glm::vec3 translation, rotation;
+			float scale;
+			instance.mesh = lookup(meshNames, "mesh", false);
+			instance.material = lookup(materialNames, "material", true);
+			if (instance.material >= 0 && materialStore[instance.material].texture >= 0)
+			{
+				// Meshes have no uv coordinates to map a texture with
+				error = "textured material on a mesh instance";
+			}
+			in >> translation.x >> translation.y >> translation.z;
+			in >> rotation.x >> rotation.y >> rotation.z >> scale;
+
+			glm::mat4 m = glm::translate(glm::mat4(1.0f), translation);
+			m = glm::rotate(m, glm::radians(rotation.z), glm::vec3(0, 0, 1));
+			m = glm::rotate(m, glm::radians(rotation.y), glm::vec3(0, 1, 0));
+			m = glm::rotate(m, glm::radians(rotation.x), glm::vec3(1, 0, 0));
+			m = glm::scale(m, glm::vec3(scale));
+			for (int column = 0; column < 4; column++)
+			{
+				for (int row = 0; row < 4; row++)
+				{
+					instance.transform[4 * column + row] = m[column][row];
+				}
+			}
+			instanceStore.push_back(instance);
+		}
+		else if (keyword == "pointlight")
+		{
+			SceneLight light = { SCENE_POINT_LIGHT, { 0 }, 0, 0, 0, 1, 1, 1 };
+			in >> light.position[0] >> light.position[1] >> light.position[2] >> light.intensity;
+			lightStore.push_back(light);
+		}
+		else if (keyword == "arealight")
+		{
+			SceneLight light = { SCENE_AREA_LIGHT, { 0, 0, 0 }, 0, 0, 0, 1, 1, 1 };
+			in >> light.position[0] >> light.position[1] >> light.position[2] >> light.intensity;
+			in >> light.width >> light.height;
+			in >> light.widthDivisions >> light.heightDivisions >> light.samples;
+			lightStore.push_back(light);
+		}
+		else
+		{
+			error = "unknown item " + keyword;
+		}
+
+		if (error.empty() && in.fail())
+		{
+			error = "missing or bad values for " + keyword;
+		}
+		if (!error.empty())
+		{
+			cout << "Scene: " << path << ":" << lineNumber << ": " << error << endl;
+			return false;
+		}
+	}
+
+	camera = recordsOf(cameraStore);
+	materials = recordsOf(materialStore);
+	spheres = recordsOf(sphereStore);
+	planes = recordsOf(planeStore);
+	meshes = recordsOf(meshStore);
+	instances = recordsOf(instanceStore);
+	lights = recordsOf(lightStore);
+	strings = recordsOf(stringStore);
+	return true;
+}
+
+bool SceneFile::mapBinary(const std::string &path)
+{
+	if (!file.open(path))
+	{
+		cout << "Scene: could not read " << path << endl;
+		return false;
+	}
+
+	SceneFileHeader header;
+	bool valid = file.size() >= sizeof(header);
+	if (valid)
+	{
+		memcpy(&header, file.data(), sizeof(header));
+		valid = memcmp(header.magic, SCENE_MAGIC, sizeof(header.magic)) == 0 &&
+			mapSection(file, header.sections[0], camera) &&
+			mapSection(file, header.sections[1], materials) &&
+			mapSection(file, header.sections[2], spheres) &&
+			mapSection(file, header.sections[3], planes) &&
+			mapSection(file, header.sections[4], meshes) &&
+			mapSection(file, header.sections[5], instances) &&
+			mapSection(file, header.sections[6], lights) &&
+			mapSection(file, header.sections[7], strings) &&
+			(strings.count == 0 || strings[strings.count - 1] == '\0');
+	}
+
+	if (!valid)
+	{
+		cout << "Scene: " << path << " is not a scene file or is damaged" << endl;
+		camera = SceneRecords<SceneCamera>();
+		materials = SceneRecords<SceneMaterial>();
+		spheres = SceneRecords<SceneSphere>();
+		planes = SceneRecords<ScenePlane>();
+		meshes = SceneRecords<SceneMesh>();
+		instances = SceneRecords<SceneInstance>();
+		lights = SceneRecords<SceneLight>();
+		strings = SceneRecords<char>();
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+bool SceneFile::saveBinary(const std::string &path) const
+{
+	SceneFileHeader header;
+	memcpy(header.magic, SCENE_MAGIC, sizeof(header.magic));
+	uint64_t counts[SCENE_SECTIONS] = { camera.count, materials.count, spheres.count, planes.count,
+		meshes.count, instances.count, lights.count, strings.count };
+	uint64_t sizes[SCENE_SECTIONS] = { sizeof(SceneCamera), sizeof(SceneMaterial), sizeof(SceneSphere),
+		sizeof(ScenePlane), sizeof(SceneMesh), sizeof(SceneInstance), sizeof(SceneLight), sizeof(char) };
+	uint64_t offset = sizeof(header);
+	for (int i = 0; i < SCENE_SECTIONS; i++)
+	{
+		offset = alignSection(offset);
+		header.sections[i] = { offset, counts[i] };
+		offset += counts[i] * sizes[i];
+	}
+
+	std::ofstream out(ofToDataPath(path), std::ios::binary);
+	out.write((const char*) &header, sizeof(header));
+	writeSection(out, camera);
+	writeSection(out, materials);
+	writeSection(out, spheres);
+	writeSection(out, planes);
+	writeSection(out, meshes);
+	writeSection(out, instances);
+	writeSection(out, lights);
+	writeSection(out, strings);
+	out.close();
+
+	if (!out)
+	{
+		cout << "Scene: could not write " << path << endl;
+		return false;
+	}
+	return true;
+}
+
+const char* SceneFile::string(int32_t offset) const
+{
+	return offset >= 0 && offset < (int32_t) strings.count ? &strings[offset] : "";
+}
+
+static ofColor toColor(const float c[3])
+{
+	return ofColor(c[0], c[1], c[2]);
+}
+
+void SceneFile::build(ofApp &app) const
+{
+	if (camera.count > 0)
+	{
+		const SceneCamera &c = camera[0];
+		app.renderCam.position = glm::vec3(c.position[0], c.position[1], c.position[2]);
+		app.renderCam.view.setSize(glm::vec2(c.viewMin[0], c.viewMin[1]), glm::vec2(c.viewMax[0], c.viewMax[1]));
+		app.renderCam.distance = c.distance;
+		app.renderCam.lookAt(app.renderCam.position + glm::vec3(c.aim[0], c.aim[1], c.aim[2]),
+							 glm::vec3(c.up[0], c.up[1], c.up[2]));
+		if (c.fov > 0)
+		{
+			app.renderCam.setFov(c.fov);
+		}
+		app.backgroundColor = toColor(c.background);
+	}
+
+	// Indices out of range, from a damaged binary file, fall back to defaults
+	auto material = [&](int32_t index) -> const SceneMaterial*
+	{
+		return index >= 0 && index < (int32_t) materials.count ? &materials[index] : nullptr;
+	};
+	auto applyColors = [](SceneObject* object, const SceneMaterial* m)
+	{
+		if (m != nullptr)
+		{
+			object->diffuseColor = toColor(m->diffuse);
+			object->specularColor = toColor(m->specular);
+		}
+	};
+
+	for (size_t i = 0; i < spheres.count; i++)
+	{
+		const SceneSphere &s = spheres[i];
+		const SceneMaterial* m = material(s.material);
+		glm::vec3 position(s.position[0], s.position[1], s.position[2]);
+		Sphere* sphere = m != nullptr && m->texture >= 0
+			? new Sphere(position, s.radius, string(m->texture), string(m->specularTexture), m->uMax, m->vMax)
+			: new Sphere(position, s.radius);
+		applyColors(sphere, m);
+		app.scene.push_back(sphere);
+	}
+
+	for (size_t i = 0; i < planes.count; i++)
+	{
+		const ScenePlane &p = planes[i];
+		const SceneMaterial* m = material(p.material);
+		glm::vec3 position(p.position[0], p.position[1], p.position[2]);
+		glm::vec3 normal(p.normal[0], p.normal[1], p.normal[2]);
+		Plane* plane = m != nullptr && m->texture >= 0
+			? new Plane(position, normal, string(m->texture), string(m->specularTexture), p.width, p.height,
+						m->uMax, m->vMax)
+			: new Plane(position, normal, ofColor::green, p.width, p.height);
+		applyColors(plane, m);
+		app.scene.push_back(plane);
+	}
+
+	// Meshes are only geometry, the instances place them in the scene
+	vector<std::shared_ptr<Mesh>> geometry;
+	for (size_t i = 0; i < meshes.count; i++)
+	{
+		geometry.push_back(std::make_shared<Mesh>(string(meshes[i].path)));
+	}
+	for (size_t i = 0; i < instances.count; i++)
+	{
+		const SceneInstance &s = instances[i];
+		if (s.mesh < 0 || s.mesh >= (int32_t) geometry.size())
+		{
+			continue;
+		}
+		glm::mat4 transform;
+		for (int column = 0; column < 4; column++)
+		{
+			for (int row = 0; row < 4; row++)
+			{
+				transform[column][row] = s.transform[4 * column + row];
+			}
+		}
+		// Only the colors apply, textured materials are refused when parsing
+		Instance* instance = new Instance(geometry[s.mesh], transform);
+		applyColors(instance, material(s.material));
+		app.scene.push_back(instance);
+	}
+
+	for (size_t i = 0; i < lights.count; i++)
+	{
+		const SceneLight &l = lights[i];
+		glm::vec3 position(l.position[0], l.position[1], l.position[2]);
+		Light* light;
+		if (l.type == SCENE_AREA_LIGHT)
+		{
+			light = new AreaLight(position, l.intensity, l.width, l.height, std::max(1, l.widthDivisions),
+								  std::max(1, l.heightDivisions), std::max(1, l.samples));
+		}
+		else
+		{
+			light = new PointLight(position, l.intensity);
+		}
+		app.addLight(light);
+	}
+}
@@ -0,0 +1,154 @@
+//
+//  scene.h
+//
+//  Scene files for the ray tracer.  Scenes are written by hand in a text
+//  form, one item per line, colors in 0-255 and angles in degrees:
+//
+//    # comment
+//    camera x y z
+//    lookat x y z              (after camera, or aim x y z for a direction)
+//    up x y z
+//    view minX minY maxX maxY distance
+//    fov degrees               (vertical, keeps the view aspect ratio)
+//    background r g b
+//    material name r g b specR specG specB [texture diffuse.jpg specular.jpg uMax vMax]
+//    sphere x y z radius material
+//    plane x y z normalX normalY normalZ width height material
+//    mesh name file.obj
+//    instance mesh material x y z rotateX rotateY rotateZ scale
+//    pointlight x y z intensity
+//    arealight x y z intensity width height widthDivisions heightDivisions samples
+//
+//  "-" stands for the default material.  Meshes have no uv coordinates, so
+//  an instance's material has to be untextured.  The same scene saved in binary form
+//  is a header and arrays of fixed size records, which load by mapping the
+//  file and reading the records in place.
+//
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mappedfile.h"
+
+class ofApp;
+
+
+// Records of the binary form, also what the text form parses into.  Strings
+// are byte offsets into the string table, -1 for none.
+//
+struct SceneCamera
+{
+	float position[3];
+	float aim[3];
+	float up[3];
+	float viewMin[2];
+	float viewMax[2];
+	float distance;           // camera to view plane
+	float fov;                // 0 to use the view rectangle as given
+	float background[3];
+};
+
+struct SceneMaterial
+{
+	float diffuse[3];
+	float specular[3];
+	int32_t texture;
+	int32_t specularTexture;
+	float uMax, vMax;
+};
+
+struct SceneSphere
+{
+	float position[3];
+	float radius;
+	int32_t material;
+};
+
+struct ScenePlane
+{
+	float position[3];
+	float normal[3];
+	float width, height;
+	int32_t material;
+};
+
+struct SceneMesh
+{
+	int32_t path;
+};
+
+struct SceneInstance
+{
+	float transform[16];      // column major
+	int32_t mesh;
+	int32_t material;
+};
+
+#define SCENE_POINT_LIGHT 0
+#define SCENE_AREA_LIGHT 1
+
+struct SceneLight
+{
+	int32_t type;
+	float position[3];
+	float intensity;
+	float width, height;
+	int32_t widthDivisions, heightDivisions, samples;
+};
+
+
+// Read only array of records, pointing into either the parsed vectors or
+// the mapped file
+//
+template<class T>
+struct SceneRecords
+{
+	const T* data = nullptr;
+	size_t count = 0;
+
+	const T &operator[](size_t i) const
+	{
+		return data[i];
+	}
+};
+
+
+class SceneFile
+{
+public:
+	// Files ending in .sceneb are mapped as binary, anything else is parsed
+	// as text.  Errors are reported with the file and line.
+	bool load(const std::string &path);
+	bool saveBinary(const std::string &path) const;
+
+	// Create the objects, lights and camera settings of the scene in app
+	void build(ofApp &app) const;
+
+	SceneRecords<SceneCamera> camera;
+	SceneRecords<SceneMaterial> materials;
+	SceneRecords<SceneSphere> spheres;
+	SceneRecords<ScenePlane> planes;
+	SceneRecords<SceneMesh> meshes;
+	SceneRecords<SceneInstance> instances;
+	SceneRecords<SceneLight> lights;
+	SceneRecords<char> strings;
+
+private:
+	bool parseText(const std::string &path);
+	bool mapBinary(const std::string &path);
+	const char* string(int32_t offset) const;
+
+	// Backing store of a text scene
+	std::vector<SceneCamera> cameraStore;
+	std::vector<SceneMaterial> materialStore;
+	std::vector<SceneSphere> sphereStore;
+	std::vector<ScenePlane> planeStore;
+	std::vector<SceneMesh> meshStore;
+	std::vector<SceneInstance> instanceStore;
+	std::vector<SceneLight> lightStore;
+	std::vector<char> stringStore;
+
+	// Backing store of a binary scene
+	MappedFile file;
+};
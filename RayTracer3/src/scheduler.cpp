@@ -0,0 +1,158 @@
+//
+//  scheduler.cpp
+//
+
+#include <algorithm>
+#include <thread>
+#include "scheduler.h"
+
+
+TileScheduler::TileScheduler(int imageWidth, int imageHeight, int tileSize)
+	: TileScheduler(Tile { 0, 0, imageWidth, imageHeight }, tileSize)
+{
+}
+
+TileScheduler::TileScheduler(const Tile &region, int tileSize)
+{
+	// Start on the grid line at or before the region's corner
+	int xStart = region.x0 - region.x0 % tileSize;
+	int yStart = region.y0 - region.y0 % tileSize;
+	std::vector<std::pair<uint32_t, Tile>> ordered;
+	for (int y = yStart; y < region.y1; y += tileSize)
+	{
+		for (int x = xStart; x < region.x1; x += tileSize)
+		{
+			Tile tile = { std::max(x, region.x0), std::max(y, region.y0),
+						  std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1) };
+			ordered.push_back({ mortonEncode((x - xStart) / tileSize, (y - yStart) / tileSize), tile });
+		}
+	}
+
+	// Codes are unique, so the order does not depend on the sort
+	std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint32_t, Tile> &a, const std::pair<uint32_t, Tile> &b)
+	{
+		return a.first < b.first;
+	});
+	for (const auto &entry : ordered)
+	{
+		tiles.push_back(entry.second);
+	}
+}
+
+void TileScheduler::selectRange(int begin, int end)
+{
+	int count = tiles.size();
+	begin = std::max(0, std::min(begin, count));
+	end = end < 0 ? count : std::max(begin, std::min(end, count));
+	tiles = std::vector<Tile>(tiles.begin() + begin, tiles.begin() + end);
+}
+
+int TileScheduler::defaultThreadCount()
+{
+	// hardware_concurrency is allowed to return 0 if it cannot tell
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void TileScheduler::run(int numThreads, const std::function<void(const Tile &, int)> &renderTile)
+{
+	numThreads = std::max(1, std::min(numThreads, (int) tiles.size()));
+
+	// Deal out equal contiguous ranges, stealing evens out the rest
+	workers = std::vector<WorkerRange>(numThreads);
+	uint32_t numTiles = tiles.size();
+	for (int w = 0; w < numThreads; w++)
+	{
+		uint32_t begin = (uint64_t) numTiles * w / numThreads;
+		uint32_t end = (uint64_t) numTiles * (w + 1) / numThreads;
+		workers[w].range.store(pack(begin, end));
+	}
+
+	std::vector<std::thread> threads;
+	for (int w = 1; w < numThreads; w++)
+	{
+		threads.emplace_back(&TileScheduler::workerLoop, this, w, std::cref(renderTile));
+	}
+	workerLoop(0, renderTile);
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+}
+
+// Take the next tile from the front of our own range
+//
+bool TileScheduler::popTile(WorkerRange &own, uint32_t &tileIndex)
+{
+	uint64_t range = own.range.load();
+	while (true)
+	{
+		uint32_t begin = range >> 32;
+		uint32_t end = range & 0xffffffff;
+		if (begin >= end)
+		{
+			return false;
+		}
+		if (own.range.compare_exchange_weak(range, pack(begin + 1, end)))
+		{
+			tileIndex = begin;
+			return true;
+		}
+	}
+}
+
+// Take the back half of another worker's range
+//
+bool TileScheduler::stealTiles(WorkerRange &victim, uint32_t &stolenBegin, uint32_t &stolenEnd)
+{
+	uint64_t range = victim.range.load();
+	while (true)
+	{
+		uint32_t begin = range >> 32;
+		uint32_t end = range & 0xffffffff;
+		if (begin >= end)
+		{
+			return false;
+		}
+		uint32_t split = end - (end - begin + 1) / 2;
+		if (victim.range.compare_exchange_weak(range, pack(begin, split)))
+		{
+			stolenBegin = split;
+			stolenEnd = end;
+			return true;
+		}
+	}
+}
+
+void TileScheduler::workerLoop(int worker, const std::function<void(const Tile &, int)> &renderTile)
+{
+	int numWorkers = workers.size();
+	WorkerRange &own = workers[worker];
+
+	while (true)
+	{
+		uint32_t tileIndex;
+		while (popTile(own, tileIndex))
+		{
+			renderTile(tiles[tileIndex], worker);
+		}
+
+		// Own range is empty, look for a victim.  If every range is empty the only
+		// tiles left are already being rendered, so this worker is done.
+		bool stole = false;
+		for (int offset = 1; offset < numWorkers && !stole; offset++)
+		{
+			uint32_t begin, end;
+			if (stealTiles(workers[(worker + offset) % numWorkers], begin, end))
+			{
+				// Keep the stolen range in our own slot so it can be stolen in turn
+				own.range.store(pack(begin, end));
+				stole = true;
+			}
+		}
+		if (!stole)
+		{
+			return;
+		}
+	}
+}
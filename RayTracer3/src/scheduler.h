@@ -0,0 +1,103 @@
+//
+//  scheduler.h
+//
+//  Tile based work scheduler for the ray tracer.  The image is cut into square
+//  tiles which are handed out to a pool of worker threads.  Each worker owns a
+//  contiguous range of tiles; when its own range runs dry it steals half of the
+//  remaining range of another worker.  Ranges are packed into a single atomic
+//  so neither popping nor stealing needs a lock.  Tiles are listed in Morton
+//  order, so every range, and every stolen half of one, is a compact patch
+//  of the image rather than a band of rows.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+// Rectangle of pixels [x0, x1) x [y0, y1) in image space
+//
+struct Tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+
+// Morton (Z order) code of a 2D position, the bits of x and y interleaved
+// with x in the low bit.  Positions close in the code are close in the plane.
+//
+inline uint32_t mortonSpread(uint32_t v)
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+inline uint32_t mortonCompact(uint32_t v)
+{
+	v &= 0x55555555;
+	v = (v | (v >> 1)) & 0x33333333;
+	v = (v | (v >> 2)) & 0x0f0f0f0f;
+	v = (v | (v >> 4)) & 0x00ff00ff;
+	v = (v | (v >> 8)) & 0x0000ffff;
+	return v;
+}
+
+inline uint32_t mortonEncode(uint32_t x, uint32_t y)
+{
+	return mortonSpread(x) | (mortonSpread(y) << 1);
+}
+
+inline void mortonDecode(uint32_t code, uint32_t &x, uint32_t &y)
+{
+	x = mortonCompact(code);
+	y = mortonCompact(code >> 1);
+}
+
+
+class TileScheduler
+{
+public:
+	TileScheduler(int imageWidth, int imageHeight, int tileSize = 32);
+
+	// Tiles covering only region.  They stay on the same tileSize grid as
+	// the whole image, clipped to the region's edges.
+	TileScheduler(const Tile &region, int tileSize = 32);
+
+	// Keep tiles [begin, end) only, so a frame can be split over several
+	// renders.  end < 0 runs to the last tile.
+	void selectRange(int begin, int end);
+
+	// Calls renderTile(tile, worker) once for every tile, spread across numThreads
+	// threads (the calling thread is worker 0).  Returns once every tile is done.
+	void run(int numThreads, const std::function<void(const Tile &, int)> &renderTile);
+
+	static int defaultThreadCount();
+
+	std::vector<Tile> tiles;
+
+private:
+	// Remaining tiles of one worker, begin in the high half and end in the low half.
+	// Padded out to a cache line so workers do not fight over the same line.
+	struct alignas(64) WorkerRange
+	{
+		std::atomic<uint64_t> range;
+	};
+
+	static uint64_t pack(uint32_t begin, uint32_t end)
+	{
+		return (static_cast<uint64_t>(begin) << 32) | end;
+	}
+
+	bool popTile(WorkerRange &own, uint32_t &tileIndex);
+	bool stealTiles(WorkerRange &victim, uint32_t &begin, uint32_t &end);
+	void workerLoop(int worker, const std::function<void(const Tile &, int)> &renderTile);
+
+	std::vector<WorkerRange> workers;
+};
@@ -0,0 +1,51 @@
+//
+//  stats.cpp
+//
+
+#include <sstream>
+#include "stats.h"
+
+
+thread_local RenderStats* threadStats = nullptr;
+
+void RenderStats::add(const RenderStats &other)
+{
+	for (int c = 0; c < STAT_COUNTERS; c++)
+	{
+		counters[c] += other.counters[c];
+	}
+	for (int t = 0; t < STAT_TIMERS; t++)
+	{
+		seconds[t] += other.seconds[t];
+	}
+}
+
+const char* RenderStats::counterName(int counter)
+{
+	static const char* names[STAT_COUNTERS] = {
+		"primary_rays", "shadow_rays", "sphere_tests", "plane_tests", "triangle_tests", "texture_fetches"
+	};
+	return names[counter];
+}
+
+const char* RenderStats::timerName(int timer)
+{
+	static const char* names[STAT_TIMERS] = { "primary_seconds", "shading_seconds", "save_seconds" };
+	return names[timer];
+}
+
+std::string RenderStats::toJson() const
+{
+	std::ostringstream out;
+	out << "{\"wall_seconds\": " << wallSeconds << ", \"rays_per_second\": " << raysPerSecond();
+	for (int c = 0; c < STAT_COUNTERS; c++)
+	{
+		out << ", \"" << counterName(c) << "\": " << counters[c];
+	}
+	for (int t = 0; t < STAT_TIMERS; t++)
+	{
+		out << ", \"" << timerName(t) << "\": " << seconds[t];
+	}
+	out << "}";
+	return out.str();
+}
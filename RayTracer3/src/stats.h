@@ -0,0 +1,102 @@
+//
+//  stats.h
+//
+//  Render statistics.  Each render thread counts into its own RenderStats,
+//  reached through a thread local pointer so the intersection tests can
+//  count without a context being passed down to them.  The per thread
+//  stats are summed once the render is done.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+
+enum StatCounter
+{
+	STAT_PRIMARY_RAYS,
+	STAT_SHADOW_RAYS,
+	STAT_SPHERE_TESTS,
+	STAT_PLANE_TESTS,
+	STAT_TRIANGLE_TESTS,
+	STAT_TEXTURE_FETCHES,
+	STAT_COUNTERS
+};
+
+enum StatTimer
+{
+	TIMER_PRIMARY,       // closest hits of primary rays
+	TIMER_SHADING,       // shading, shadow rays included
+	TIMER_SAVE,          // writing the image file
+	STAT_TIMERS
+};
+
+
+// Padded to a cache line so threads counting side by side do not share one
+//
+struct alignas(64) RenderStats
+{
+	uint64_t counters[STAT_COUNTERS] = {};
+	double seconds[STAT_TIMERS] = {};     // summed over threads
+	double wallSeconds = 0;
+
+	void add(const RenderStats &other);
+
+	uint64_t rays() const
+	{
+		return counters[STAT_PRIMARY_RAYS] + counters[STAT_SHADOW_RAYS];
+	}
+
+	double raysPerSecond() const
+	{
+		return wallSeconds > 0 ? rays() / wallSeconds : 0;
+	}
+
+	// Flat JSON object of every counter and timer
+	std::string toJson() const;
+
+	static const char* counterName(int counter);
+	static const char* timerName(int timer);
+};
+
+
+// Stats of the render work on this thread, null outside of it
+extern thread_local RenderStats* threadStats;
+
+inline void countStat(StatCounter counter, uint64_t amount = 1)
+{
+	if (threadStats != nullptr)
+	{
+		threadStats->counters[counter] += amount;
+	}
+}
+
+
+// Adds the time until it goes out of scope to a timer, of this thread's
+// stats unless given others
+//
+class ScopedTimer
+{
+public:
+	ScopedTimer(StatTimer timer, RenderStats* stats = threadStats)
+		: timer(timer), stats(stats), start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~ScopedTimer()
+	{
+		if (stats != nullptr)
+		{
+			stats->seconds[timer] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	ScopedTimer(const ScopedTimer &) = delete;
+	ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+	StatTimer timer;
+	RenderStats* stats;
+	std::chrono::steady_clock::time_point start;
+};
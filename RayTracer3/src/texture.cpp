@@ -0,0 +1,305 @@
+//
+//  texture.cpp
+//
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include "ofMain.h"
+#include "texture.h"
+
+#define TEXTURE_CACHE_DIRECTORY "texture_cache"
+#define TEXTURE_CACHE_MAGIC "RTTEX01"
+
+// Cache files hold, in order and in the byte order of the machine that
+// wrote them: the header, the key, one CacheLevel per mip level, padding
+// to a cache line, then the texels of every level as laid out in storage.
+//
+struct CacheHeader
+{
+	char magic[8];
+	int64_t diffuseTime;
+	int64_t specularTime;
+	uint32_t keyLength;
+	uint32_t levelCount;
+	uint64_t texelOffset;     // bytes from the start of the file
+	uint64_t texelCount;
+};
+
+struct CacheLevel
+{
+	int32_t width;
+	int32_t height;
+	int32_t tilesX;
+	int32_t pad;
+	uint64_t offset;          // texels from the first one
+};
+
+static_assert(sizeof(Texel) == 8, "cache files assume 8 byte texels");
+
+
+// Source file time, 0 if it cannot be read
+//
+static int64_t modifiedTime(const std::string &path)
+{
+	std::error_code error;
+	auto time = std::filesystem::last_write_time(path, error);
+	return error ? 0 : (int64_t) time.time_since_epoch().count();
+}
+
+// Cache file name from a hash of the key, FNV-1a so it is the same on
+// every platform and run
+//
+static std::string cacheFilePath(const std::string &key)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : key)
+	{
+		hash = (hash ^ c) * 1099511628211ull;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.tex", (unsigned long long) hash);
+	return ofToDataPath(std::string(TEXTURE_CACHE_DIRECTORY) + "/" + name);
+}
+
+
+std::shared_ptr<Texture> Texture::get(const std::string &diffusePath, const std::string &specularPath)
+{
+	// The cache does not keep textures alive, the objects using them do
+	static std::mutex cacheMutex;
+	static std::map<std::string, std::weak_ptr<Texture>> cache;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	std::weak_ptr<Texture> &entry = cache[diffusePath + '\n' + specularPath];
+	std::shared_ptr<Texture> texture = entry.lock();
+	if (texture == nullptr)
+	{
+		texture = std::make_shared<Texture>();
+		if (!texture->load(diffusePath, specularPath))
+		{
+			cout << "Texture: could not load " << diffusePath << endl;
+		}
+		entry = texture;
+	}
+	return texture;
+}
+
+bool Texture::load(const std::string &diffusePath, const std::string &specularPath)
+{
+	std::string key = diffusePath + '\n' + specularPath;
+	std::string cachePath = cacheFilePath(key);
+	int64_t diffuseTime = modifiedTime(diffusePath);
+	int64_t specularTime = modifiedTime(specularPath);
+	if (diffuseTime != 0 && mapCache(cachePath, key, diffuseTime, specularTime))
+	{
+		return true;
+	}
+
+	if (!decode(diffusePath, specularPath))
+	{
+		return false;
+	}
+	if (diffuseTime != 0)
+	{
+		writeCache(cachePath, key, diffuseTime, specularTime);
+	}
+	return true;
+}
+
+bool Texture::mapCache(const std::string &cachePath, const std::string &key, int64_t diffuseTime,
+					   int64_t specularTime)
+{
+	if (!cacheFile.open(cachePath))
+	{
+		return false;
+	}
+
+	// Anything that does not match the sources or does not fit in the file
+	// is stale or damaged, and gets decoded and written again.  The bounds
+	// are checked by subtraction so a damaged offset or count cannot wrap
+	// around into a range that passes.
+	const unsigned char* data = cacheFile.data();
+	size_t size = cacheFile.size();
+	CacheHeader header;
+	bool valid = size >= sizeof(header);
+	if (valid)
+	{
+		memcpy(&header, data, sizeof(header));
+		size_t tableEnd = sizeof(header) + header.keyLength + header.levelCount * sizeof(CacheLevel);
+		valid = memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+			header.diffuseTime == diffuseTime && header.specularTime == specularTime &&
+			header.keyLength == key.size() && header.levelCount > 0 &&
+			tableEnd <= header.texelOffset && header.texelOffset % alignof(Texel) == 0 &&
+			header.texelOffset <= size && header.texelCount <= (size - header.texelOffset) / sizeof(Texel) &&
+			memcmp(data + sizeof(header), key.data(), key.size()) == 0;
+	}
+
+	const Texel* texels = (const Texel*) (data + (valid ? header.texelOffset : 0));
+	const unsigned char* table = data + sizeof(header) + key.size();
+	for (uint32_t i = 0; valid && i < header.levelCount; i++)
+	{
+		CacheLevel record;
+		memcpy(&record, table + i * sizeof(CacheLevel), sizeof(record));
+		uint64_t tilesY = (record.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		uint64_t count = record.tilesX * tilesY * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+		valid = record.width > 0 && record.height > 0 &&
+			record.tilesX == (record.width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE &&
+			record.offset <= header.texelCount && count <= header.texelCount - record.offset;
+		levels.push_back({ record.width, record.height, record.tilesX, texels + record.offset });
+	}
+
+	if (!valid)
+	{
+		levels.clear();
+		cacheFile.close();
+	}
+	return valid;
+}
+
+void Texture::writeCache(const std::string &cachePath, const std::string &key, int64_t diffuseTime,
+						 int64_t specularTime) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(cachePath).parent_path(), error);
+
+	CacheHeader header;
+	memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic));
+	header.diffuseTime = diffuseTime;
+	header.specularTime = specularTime;
+	header.keyLength = key.size();
+	header.levelCount = levels.size();
+	size_t tableEnd = sizeof(header) + key.size() + levels.size() * sizeof(CacheLevel);
+	header.texelOffset = (tableEnd + 63) / 64 * 64;
+	header.texelCount = storage.size();
+
+	// Written under another name and renamed, so a reader never maps a
+	// half written file
+	std::string temporaryPath = cachePath + ".tmp";
+	std::ofstream file(temporaryPath, std::ios::binary);
+	file.write((const char*) &header, sizeof(header));
+	file.write(key.data(), key.size());
+	for (const TextureLevel &level : levels)
+	{
+		CacheLevel record = { level.width, level.height, level.tilesX, 0, (uint64_t) (level.texels - storage.data()) };
+		file.write((const char*) &record, sizeof(record));
+	}
+	std::vector<char> padding(header.texelOffset - tableEnd, 0);
+	file.write(padding.data(), padding.size());
+	file.write((const char*) storage.data(), storage.size() * sizeof(Texel));
+	file.close();
+
+	if (!file)
+	{
+		cout << "Texture: could not write cache " << cachePath << endl;
+		std::filesystem::remove(temporaryPath, error);
+		return;
+	}
+	std::filesystem::rename(temporaryPath, cachePath, error);
+}
+
+int Texture::levelFor(float footprint) const
+{
+	if (footprint <= 1.0f)
+	{
+		return 0;
+	}
+	int index = (int) floor(log2(footprint) + 0.5f);
+	return std::min(index, levelCount() - 1);
+}
+
+bool Texture::decode(const std::string &diffusePath, const std::string &specularPath)
+{
+	ofPixels diffusePixels;
+	ofPixels specularPixels;
+	if (!ofLoadImage(diffusePixels, diffusePath))
+	{
+		return false;
+	}
+
+	// Specular is looked up with the diffuse texel coordinates, so it has to
+	// match its size.  A missing specular map reads as black.
+	int w = diffusePixels.getWidth();
+	int h = diffusePixels.getHeight();
+	bool hasSpecular = ofLoadImage(specularPixels, specularPath);
+	if (hasSpecular && ((int) specularPixels.getWidth() != w || (int) specularPixels.getHeight() != h))
+	{
+		specularPixels.resize(w, h);
+	}
+
+	// Lay out every level, each padded to whole tiles.  The padding is never
+	// fetched.
+	std::vector<size_t> offsets;
+	size_t size = 0;
+	while (true)
+	{
+		TextureLevel level;
+		level.width = w;
+		level.height = h;
+		level.tilesX = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		level.texels = nullptr;
+		levels.push_back(level);
+		offsets.push_back(size);
+
+		int tilesY = (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		size += level.tilesX * tilesY * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+		if (w == 1 && h == 1)
+		{
+			break;
+		}
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+	storage.assign(size, Texel());
+	for (int i = 0; i < (int) levels.size(); i++)
+	{
+		levels[i].texels = storage.data() + offsets[i];
+	}
+
+	const TextureLevel &top = levels[0];
+	for (int j = 0; j < top.height; j++)
+	{
+		for (int i = 0; i < top.width; i++)
+		{
+			Texel &texel = storage[TextureLevel::texelIndex(top.tilesX, i, j)];
+			ofColor diffuse = diffusePixels.getColor(i, j);
+			ofColor specular = hasSpecular ? specularPixels.getColor(i, j) : ofColor::black;
+			texel.diffuse[0] = diffuse.r;
+			texel.diffuse[1] = diffuse.g;
+			texel.diffuse[2] = diffuse.b;
+			texel.specular[0] = specular.r;
+			texel.specular[1] = specular.g;
+			texel.specular[2] = specular.b;
+		}
+	}
+
+	for (int i = 1; i < (int) levels.size(); i++)
+	{
+		const TextureLevel &above = levels[i - 1];
+		const TextureLevel &below = levels[i];
+		for (int y = 0; y < below.height; y++)
+		{
+			for (int x = 0; x < below.width; x++)
+			{
+				// Odd sizes repeat the last row or column of the level above
+				int x0 = std::min(2 * x, above.width - 1);
+				int x1 = std::min(2 * x + 1, above.width - 1);
+				int y0 = std::min(2 * y, above.height - 1);
+				int y1 = std::min(2 * y + 1, above.height - 1);
+				const Texel &a = above.fetch(x0, y0);
+				const Texel &b = above.fetch(x1, y0);
+				const Texel &c = above.fetch(x0, y1);
+				const Texel &d = above.fetch(x1, y1);
+
+				Texel &texel = storage[offsets[i] + TextureLevel::texelIndex(below.tilesX, x, y)];
+				for (int k = 0; k < 3; k++)
+				{
+					texel.diffuse[k] = (a.diffuse[k] + b.diffuse[k] + c.diffuse[k] + d.diffuse[k] + 2) / 4;
+					texel.specular[k] = (a.specular[k] + b.specular[k] + c.specular[k] + d.specular[k] + 2) / 4;
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,110 @@
+//
+//  texture.h
+//
+//  Decoded textures shared between scene objects.  A diffuse map and its
+//  specular map are decoded once and kept for as long as any object uses
+//  them.  Texels are stored in 8x8 tiles so nearby lookups land on the same
+//  cache lines, with the diffuse and specular colors of a texel side by side
+//  so a single fetch serves both.  Each texture keeps a mip pyramid down to
+//  1x1, every level averaging 2x2 texels of the one above.
+//
+//  Decoded pyramids are written to a cache directory next to the data, keyed
+//  by source paths and modification times, and later runs map them straight
+//  from disk instead of decoding the images again.
+//
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mappedfile.h"
+
+#define TEXTURE_TILE_SHIFT 3
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_SHIFT)
+
+
+// Diffuse and specular color of one texel, padded to 8 bytes
+//
+struct Texel
+{
+	unsigned char diffuse[3];
+	unsigned char specular[3];
+	unsigned char pad[2];
+};
+
+
+// One mip level, texels are laid out tile by tile with tilesX tiles per row
+//
+struct TextureLevel
+{
+	int width;
+	int height;
+	int tilesX;
+	const Texel* texels;
+
+	const Texel &fetch(int i, int j) const
+	{
+		return texels[texelIndex(tilesX, i, j)];
+	}
+
+	static int texelIndex(int tilesX, int i, int j)
+	{
+		int tile = (j >> TEXTURE_TILE_SHIFT) * tilesX + (i >> TEXTURE_TILE_SHIFT);
+		int offset = ((j & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) | (i & (TEXTURE_TILE_SIZE - 1));
+		return tile * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE + offset;
+	}
+};
+
+
+class Texture
+{
+public:
+	// Texture for a pair of image files, decoded on first use and shared
+	// with every later caller while it is still referenced
+	static std::shared_ptr<Texture> get(const std::string &diffusePath, const std::string &specularPath);
+
+	bool isEmpty() const
+	{
+		return levels.empty();
+	}
+
+	int getWidth() const
+	{
+		return levels[0].width;
+	}
+
+	int getHeight() const
+	{
+		return levels[0].height;
+	}
+
+	int levelCount() const
+	{
+		return levels.size();
+	}
+
+	const TextureLevel &level(int index) const
+	{
+		return levels[index];
+	}
+
+	// Level whose texels best match a footprint of the given number of full
+	// resolution texels
+	int levelFor(float footprint) const;
+
+private:
+	bool load(const std::string &diffusePath, const std::string &specularPath);
+	bool decode(const std::string &diffusePath, const std::string &specularPath);
+
+	// Decoded pyramid cache, key identifies the source files
+	bool mapCache(const std::string &cachePath, const std::string &key, int64_t diffuseTime, int64_t specularTime);
+	void writeCache(const std::string &cachePath, const std::string &key, int64_t diffuseTime,
+					int64_t specularTime) const;
+
+	// Texel data is only reached through the level pointers, which point
+	// either into storage or into the mapped cache file
+	std::vector<TextureLevel> levels;
+	std::vector<Texel> storage;
+	MappedFile cacheFile;
+};